@@ -1,11 +1,43 @@
+#include <linux/atomic.h>
+#include <linux/bitmap.h>
+#include <linux/capability.h>
+#include <linux/debugfs.h>
 #include <linux/device.h>
 #include <linux/fs.h>
+#include <linux/hrtimer.h>
+#include <linux/idr.h>
+#include <linux/in.h>
 #include <linux/init.h>
 #include <linux/input.h>
 #include <linux/input/mt.h>
 #include <linux/kernel.h>
+#include <linux/kfifo.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/net.h>
+#include <linux/percpu.h>
+#include <linux/poll.h>
+#include <linux/sched/signal.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/suspend.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#include <asm/unaligned.h>
+#include <net/sock.h>
+
+#include "toccami.h"
+
+#define CREATE_TRACE_POINTS
+#include "toccami_trace.h"
 
 #define DEVICE_NAME "toccamich"
 #define CLASS_NAME "toccami"
@@ -16,36 +48,525 @@ MODULE_DESCRIPTION("Virtual Touchpad driver for Toccami");
 MODULE_VERSION("1.0");
 
 static int majorNumber;
-static int numberOpens = 0;
+static atomic_t numberOpens = ATOMIC_INIT(0);
 static struct class *toccamiClass = NULL;
 static struct device *toccamiDevice = NULL;
 
-static DEFINE_MUTEX(toccamiMutex);
-
 static int dev_open(struct inode *, struct file *);
 static int dev_release(struct inode *, struct file *);
-static ssize_t dev_read(struct file *, char *, size_t, loff_t *);
-static ssize_t dev_write(struct file *, const char *, size_t, loff_t *);
+static ssize_t dev_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t dev_write_iter(struct kiocb *, struct iov_iter *);
+static long dev_ioctl(struct file *, unsigned int, unsigned long);
+static int dev_mmap(struct file *, struct vm_area_struct *);
+static __poll_t dev_poll(struct file *, poll_table *);
 
 static struct file_operations fops = {
+    .owner = THIS_MODULE,
     .open = dev_open,
-    .read = dev_read,
-    .write = dev_write,
+    .read_iter = dev_read_iter,
+    .write_iter = dev_write_iter,
+    .unlocked_ioctl = dev_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .mmap = dev_mmap,
+    .poll = dev_poll,
     .release = dev_release,
 };
 
-static struct input_dev *toccamiInput;
-
 #define AXIS_X_MIN 0
 #define AXIS_Y_MIN 0
-#define AXIS_X_MAX 1000
-#define AXIS_Y_MAX 400
-#define MAX_TOUCHES 10
 
-#define TEMP_RESOLUTION_X 10
-#define TEMP_RESOLUTION_Y 10
+// Slots are indexed by an u8 in slotByPointer
+#define MAX_TOUCHES_LIMIT 64
+
+/* Events generated by a frame: ABS_MT_SLOT, ABS_MT_TRACKING_ID,
+ * ABS_MT_TOOL_TYPE and the position for every contact, then the pointer
+ * emulation, MSC_TIMESTAMP and SYN_REPORT
+ */
+#define EVENTS_PER_CONTACT 5
+#define EVENTS_PER_FRAME 8
+// ABS_MT_PRESSURE, ABS_MT_ORIENTATION, ABS_MT_TOUCH_MAJOR/MINOR
+#define EVENTS_PER_CONTACT_ATTRS 4
+
+// Upper bound for max_write_records, keeps the staging buffer a few pages
+#define MAX_WRITE_RECORDS_LIMIT 4096
+
+// Upper bound for the number of virtual touchpads
+#define MAX_DEVICES 64
+
+// Records moved out of a client queue at once by the device worker
+#define DRAIN_BATCH 64
+
+// Datagrams received by one run of the UDP work, which queues itself again
+// for the rest so that a flood does not hold the client lock
+#define UDP_BUDGET 64
+
+// Pointers are mapped on slots by a table indexed by pointerIndex
+#define MAX_POINTER_ID_LIMIT 65536
+#define NO_SLOT U8_MAX
+
+// Pointer ids of the compact format are a single byte
+#define COMPACT_POINTERS 256
+
+// Latency histograms have log2 buckets of nanoseconds, the last one is open
+#define LATENCY_BUCKETS 32
+
+// Reasons for a device to be drained, bits of quiesce
+#define QUIESCE_DRAIN 0
+#define QUIESCE_SUSPEND 1
+
+// Upper bound for capture_records, 16 MiB of entries
+#define MAX_CAPTURE_RECORDS (1 << 20)
+
+/* Gesture recognition: a tap lasts less than GESTURE_TAP_MS with no contact
+ * moving further than GESTURE_TAP_MM, two contacts moving together by
+ * GESTURE_SCROLL_MM or apart by GESTURE_PINCH_MM start a scroll or a pinch
+ * and emit a step every such distance
+ */
+#define GESTURE_TAP_MS 180
+#define GESTURE_TAP_MM 3
+#define GESTURE_SCROLL_MM 3
+#define GESTURE_PINCH_MM 6
+
+// Samples kept per slot for resampling
+#define RESAMPLE_HISTORY 4
+// Upper bound for output_rate
+#define MAX_OUTPUT_RATE 1000
+// Resampled positions are extrapolated over this much time at most
+#define RESAMPLE_MAX_EXTRAPOLATION_NS (20 * NSEC_PER_MSEC)
+
+/* Upper bound for predict_ms. The velocity of a contact is measured over its
+ * samples of the last PREDICT_WINDOW_NS
+ */
+#define MAX_PREDICT_MS 50
+#define PREDICT_WINDOW_NS (50 * NSEC_PER_MSEC)
+
+// pointerIndex of a queued frame separator closing a frame without contact
+// transitions, only set when drop_motion is enabled
+#define SYNC_MOTION_FRAME 1
+
+/* Geometry of the virtual touchpads, read when a device is created: changes
+ * through sysfs apply to the devices created afterwards
+ */
+static unsigned int max_touches = 10;
+module_param(max_touches, uint, 0644);
+MODULE_PARM_DESC(max_touches, "Number of contacts tracked by a touchpad");
+
+static unsigned int axis_x_max = 1000;
+module_param(axis_x_max, uint, 0644);
+MODULE_PARM_DESC(axis_x_max, "Maximum X coordinate");
+
+static unsigned int axis_y_max = 400;
+module_param(axis_y_max, uint, 0644);
+MODULE_PARM_DESC(axis_y_max, "Maximum Y coordinate");
+
+static unsigned int resolution_x = 10;
+module_param(resolution_x, uint, 0644);
+MODULE_PARM_DESC(resolution_x, "X resolution in units per mm");
+
+static unsigned int resolution_y = 10;
+module_param(resolution_y, uint, 0644);
+MODULE_PARM_DESC(resolution_y, "Y resolution in units per mm");
+
+static unsigned int events_per_packet;
+module_param(events_per_packet, uint, 0644);
+MODULE_PARM_DESC(events_per_packet,
+                 "Events per frame hint sizing the evdev client buffers, 0 "
+                 "computes it from max_touches");
+
+static unsigned int max_write_records = 256;
+module_param(max_write_records, uint, 0444);
+MODULE_PARM_DESC(max_write_records,
+                 "Maximum number of event records accepted by one write()");
+
+static unsigned int queue_records = 1024;
+module_param(queue_records, uint, 0444);
+MODULE_PARM_DESC(queue_records,
+                 "Number of event records queued per client before "
+                 "writers wait for the device worker");
+
+static bool drop_motion;
+module_param(drop_motion, bool, 0444);
+MODULE_PARM_DESC(drop_motion,
+                 "When a client queue is full, merge its oldest motion-only "
+                 "frames instead of waiting, contacts going down or up are "
+                 "never dropped");
+
+static unsigned int max_pointer_id = 256;
+module_param(max_pointer_id, uint, 0444);
+MODULE_PARM_DESC(max_pointer_id,
+                 "Records with a pointerIndex higher or equal are ignored");
+
+static bool coalesce_motion;
+module_param(coalesce_motion, bool, 0644);
+MODULE_PARM_DESC(coalesce_motion,
+                 "Skip contacts that did not move since they were last "
+                 "reported");
+
+static unsigned int motion_threshold;
+module_param(motion_threshold, uint, 0644);
+MODULE_PARM_DESC(motion_threshold,
+                 "With coalesce_motion, largest move on both axes that is "
+                 "still skipped");
+
+static bool contact_attrs;
+module_param(contact_attrs, bool, 0644);
+MODULE_PARM_DESC(contact_attrs,
+                 "Advertise and report pressure, touch major/minor and "
+                 "orientation of contacts on the touchpads created afterwards");
+
+static bool gestures;
+module_param(gestures, bool, 0644);
+MODULE_PARM_DESC(gestures,
+                 "Recognize taps, two finger scroll and pinch on the touchpads "
+                 "created afterwards and report them on a companion device");
+
+static bool pen;
+module_param(pen, bool, 0644);
+MODULE_PARM_DESC(pen,
+                 "Report TOCCAMI_EVENT_PEN records on a companion tablet "
+                 "device of the touchpads created afterwards");
+
+static unsigned int watchdog_ms;
+module_param(watchdog_ms, uint, 0644);
+MODULE_PARM_DESC(watchdog_ms,
+                 "Release the contacts of a producer that sent no frame for "
+                 "this many milliseconds, 0 disables it");
+
+static unsigned int output_rate;
+module_param(output_rate, uint, 0644);
+MODULE_PARM_DESC(output_rate,
+                 "Report frames at this rate in Hz on the touchpads created "
+                 "afterwards, resampling contact positions, 0 reports them "
+                 "as they arrive");
+
+static unsigned int resample_delay_us = 8000;
+module_param(resample_delay_us, uint, 0644);
+MODULE_PARM_DESC(resample_delay_us,
+                 "With output_rate, age of the resampled positions: samples "
+                 "arriving later than this are extrapolated");
+
+static unsigned int predict_ms;
+module_param(predict_ms, uint, 0644);
+MODULE_PARM_DESC(predict_ms,
+                 "Report contacts where their recent velocity puts them this "
+                 "many milliseconds later, on the touchpads created "
+                 "afterwards, 0 disables the prediction");
+
+static unsigned int capture_records;
+module_param(capture_records, uint, 0644);
+MODULE_PARM_DESC(capture_records,
+                 "Keep the last records accepted by the touchpads created "
+                 "afterwards in a debugfs capture file, rounded up to a power "
+                 "of two, 0 disables it");
+
+static bool hw_timestamps;
+module_param(hw_timestamps, bool, 0444);
+MODULE_PARM_DESC(hw_timestamps,
+                 "Report source capture times through MSC_TIMESTAMP");
+
+static bool force_feedback;
+module_param(force_feedback, bool, 0644);
+MODULE_PARM_DESC(force_feedback,
+                 "Advertise rumble on the touchpads created afterwards and "
+                 "forward the effects played to their producers");
+
+// Position of a contact at a given time on CLOCK_MONOTONIC
+struct toccami_sample {
+  u64 ns;
+  u16 x;
+  u16 y;
+};
+
+// Contact state of an input slot, as last reported to the input core
+struct toccami_slot {
+  bool active;
+  // The slot was mentioned by the current frame
+  bool seen;
+  u16 pointerIndex;
+  u16 x;
+  u16 y;
+  // Position where the contact went down
+  u16 startX;
+  u16 startY;
+  // Client that reported the contact, its contacts are released on close
+  struct toccami_client *owner;
+
+  // With output_rate or predict_ms: the last sampleCount % RESAMPLE_HISTORY
+  // samples. With output_rate: the time of the release not rendered yet or
+  // 0, and whether the contact is down for the input core
+  struct toccami_sample samples[RESAMPLE_HISTORY];
+  unsigned int sampleCount;
+  u64 releaseNs;
+  bool rendered;
+  // Without output_rate: the position last reported was a prediction
+  bool predicted;
+};
+
+enum toccami_gesture_mode {
+  GESTURE_NONE,
+  GESTURE_SCROLL,
+  GESTURE_PINCH,
+};
+
+// Gesture in progress since the first contact went down
+struct toccami_gesture {
+  u64 startNs;
+  unsigned int maxContacts;
+  // A contact went further than GESTURE_TAP_MM, this is not a tap
+  bool moved;
+  enum toccami_gesture_mode mode;
+  // The previous frame had two contacts, at centroidX, centroidY and spread
+  // apart
+  bool twoContacts;
+  int centroidX;
+  int centroidY;
+  int spread;
+  // Movement not emitted yet
+  int scrollX;
+  int scrollY;
+  int pinch;
+};
+
+// Stylus state, as last reported to the pen device
+struct toccami_pen {
+  bool inRange;
+  // BTN_TOOL_PEN or BTN_TOOL_RUBBER while in range
+  unsigned int tool;
+  // From the last TOCCAMI_EVENT_PEN_TILT
+  int tiltX;
+  int tiltY;
+  int distance;
+  // Client that reported the stylus, it leaves proximity on close
+  struct toccami_client *owner;
+};
+
+// Per-CPU counters of a device, exported in debugfs
+struct toccami_stats {
+  u64 records;
+  u64 frames;
+  u64 bytes;
+  u64 invalidSize;
+  u64 faults;
+  u64 dropped;
+  u64 coalesced;
+  // Frames releasing the contacts left down by the watchdog
+  u64 watchdog;
+  // Datagrams of the UDP receiver that found the queue full
+  u64 udpDropped;
+  // Time spent in dev_write_iter
+  u64 writeLatency[LATENCY_BUCKETS];
+  // From the capture time of a frame to its input_sync
+  u64 syncLatency[LATENCY_BUCKETS];
+};
+
+// Positions of the pointers down in the compact format of a client
+struct toccami_compact_state {
+  u16 x[COMPACT_POINTERS];
+  u16 y[COMPACT_POINTERS];
+  DECLARE_BITMAP(down, COMPACT_POINTERS);
+};
+
+/* Event record in host memory, the ones written by producers are
+ * little-endian struct toccami_event. On little-endian hosts they are the
+ * same and the conversions compile away
+ */
+struct toccami_record {
+  u16 x;
+  u16 y;
+  u16 pointerIndex;
+  u16 eventType;
+};
+static_assert(sizeof(struct toccami_record) == sizeof(struct toccami_event));
+
+// Read a record written by a producer, each field only once
+static inline struct toccami_record
+toccami_record_from_event(const struct toccami_event *event) {
+  return (struct toccami_record){
+      .x = le16_to_cpu(READ_ONCE(event->x)),
+      .y = le16_to_cpu(READ_ONCE(event->y)),
+      .pointerIndex = le16_to_cpu(READ_ONCE(event->pointerIndex)),
+      .eventType = le16_to_cpu(READ_ONCE(event->eventType))};
+}
+
+/* A virtual touchpad: the one created at init is shared by every client,
+ * the others are private to the client that created them.
+ * Clients never report events themselves: they queue records and a single
+ * worker per device drains the queues and talks to the input core, so
+ * producers never wait for each other.
+ */
+struct toccami_device {
+  struct input_dev *input;
+  int id;
+  char phys[32];
+  // In toccamiDevices
+  struct list_head node;
+
+  struct toccami_stats __percpu *stats;
+  struct dentry *debugfsDir;
+
+  // Ring of the last captureSize records accepted, NULL if disabled.
+  // captureHead counts every entry ever written
+  struct toccami_capture_entry *capture;
+  u32 captureSize;
+  u64 captureHead;
+  spinlock_t captureLock;
+
+  // Companion device of the recognized gestures, NULL if disabled
+  struct input_dev *gestures;
+  char gesturesPhys[40];
+  // Companion tablet device of TOCCAMI_EVENT_PEN records, NULL if disabled
+  struct input_dev *pen;
+  char penPhys[40];
+
+  struct work_struct work;
+  // Queues the work when the contacts of a client may have gone watchdog_ms
+  // without a frame
+  struct hrtimer watchdog;
+  // Output clock of the resampled frames, runs while resampling is true and
+  // sets resampleTick for the work
+  struct hrtimer resampleTimer;
+  u64 outputPeriodNs;
+  u64 resampleDelayNs;
+  // How far ahead contacts are predicted, 0 if disabled
+  u64 predictNs;
+  bool resampling;
+  atomic_t resampleTick;
+
+  // Read back channel: clients have a message pending when their copy of a
+  // sequence differs from the device one
+  wait_queue_head_t readWait;
+  atomic_t statusSequence;
+  // Bitmap of the active slots after the last sync
+  u64 activeMask;
+  // Rumble played by the input core, from timer context
+  spinlock_t ffLock;
+  atomic_t ffSequence;
+  u16 ffStrong;
+  u16 ffWeak;
+  // Some process has the input device or the gestures device open, set by
+  // the input core. The device is idle while neither is
+  bool inputOpen;
+  bool gesturesOpen;
+  // QUIESCE_* bits: while any is set the device is idle and refuses writes
+  unsigned long quiesce;
+
+  // Held by the worker, protects everything below
+  struct mutex lock;
+  struct list_head clients;
+  // Records were reported since the last sync
+  bool framePending;
+  // Nobody listens to the input device or it is drained: the worker skips
+  // the records and released the contacts
+  bool idle;
+  // TOCCAMI_EVENT_CONTACT_ATTR records are reported
+  bool contactAttrs;
+  unsigned int numSlots;
+  struct toccami_slot *slots;
+  // Slots that are active or were released by the current frame
+  unsigned long *busySlots;
+  // Capture time of the current frame on CLOCK_MONOTONIC, 0 if unknown
+  s64 frameTimestamp;
+  // Applied to the positions before reporting, disabled if width is 0
+  struct toccami_transform transform;
+  struct toccami_gesture gesture;
+  struct toccami_pen penState;
+  struct toccami_record drain[DRAIN_BATCH];
+};
+
+// State of an open file, i.e. of a producer
+struct toccami_client {
+  struct toccami_device *device;
+  struct list_head node;
+  // The device was created by TOCCAMI_IOC_DEV_CREATE and dies with the client
+  bool ownsDevice;
+
+  // Serializes the producer side operations on this client
+  struct mutex lock;
+
+  // Whole write() payloads get copied here before being queued
+  struct toccami_record *staging;
+  // Slot of each pointerIndex of this client, NO_SLOT if it is not down.
+  // Only used by the device worker, clients sharing a touchpad each number
+  // their pointers from 0
+  u8 *slotByPointer;
+
+  // TOCCAMI_FORMAT_* of the writes
+  unsigned int format;
+  // Compact writes are copied to wire and decoded to staging. compact[0]
+  // holds the positions after the last queued write, compact[1] is the
+  // decoder copy. Allocated when the format is first selected
+  u8 *wire;
+  struct toccami_compact_state *compact;
+
+  /* Single producer single consumer queue to the device worker, records of a
+   * write become visible to the worker all together.
+   * queueLock is only taken by the worker and by the producer when it
+   * compacts the queue
+   */
+  DECLARE_KFIFO_PTR(queue, struct toccami_record);
+  spinlock_t queueLock;
+  wait_queue_head_t queueWait;
+  // Copy of the queue used while compacting it, allocated on demand
+  struct toccami_record *compactBuffer;
+  // Pointers down after the last queued frame, MAX_TOUCHES_LIMIT + 1 if
+  // unknown
+  u16 framePointers[MAX_TOUCHES_LIMIT];
+  unsigned int framePointerCount;
+
+  // Shared memory ring mapped by the producer, NULL until mmap(). mmap() runs
+  // under mmap_lock, which write and the ioctls may take while holding lock,
+  // so the first mapping claims ringMapped instead
+  atomic_t ringMapped;
+  struct toccami_ring_header *ring;
+  struct toccami_event *ringRecords;
+  // Private copies of the header fields, the shared ones are only a mirror.
+  // ringHead is the last head announced by a doorbell, ringTail is owned by
+  // the device worker
+  u32 ringSize;
+  u32 ringHead;
+  u32 ringTail;
 
-#define EVENT_PER_PACKET 10
+  // In-kernel UDP receiver and the producer it accepts, its work reads them
+  // under lock
+  struct socket *udpSocket;
+  struct toccami_udp_bind udpBind;
+  struct work_struct udpWork;
+
+  // Sequences of the device messages last read
+  atomic_t statusSeen;
+  atomic_t ffSeen;
+
+  // Mapping of the producer capture clock on CLOCK_MONOTONIC
+  bool clockValid;
+  s64 clockOffset;
+  u64 clockLastUs;
+
+  // CLOCK_MONOTONIC of the last frame of this client, for the watchdog.
+  // Written by the device worker
+  u64 lastSyncNs;
+};
+
+static struct toccami_device *toccamiDefault;
+// Every device, for the PM notifier
+static LIST_HEAD(toccamiDevices);
+static DEFINE_MUTEX(toccamiDevicesLock);
+static DEFINE_IDA(toccamiIda);
+static struct workqueue_struct *toccamiWq;
+static struct dentry *toccamiDebugfs;
+
+static void toccami_device_work(struct work_struct *);
+static void toccami_udp_work(struct work_struct *);
+static void toccami_client_udp_set(struct toccami_client *, struct socket *,
+                                   const struct toccami_udp_bind *);
+static enum hrtimer_restart toccami_device_watchdog(struct hrtimer *);
+static enum hrtimer_restart toccami_device_resample_tick(struct hrtimer *);
+static bool toccami_device_release(struct toccami_device *,
+                                   struct toccami_client *);
+static int toccami_pm_notify(struct notifier_block *, unsigned long, void *);
+
+static struct notifier_block toccamiPmNotifier = {
+    .notifier_call = toccami_pm_notify,
+};
 
 static int toccami_device_777_permission(struct device *dev,
                                          struct kobj_uevent_env *env) {
@@ -53,15 +574,458 @@ static int toccami_device_777_permission(struct device *dev,
   return 0;
 }
 
-static int __init toccami_init(void) {
+static unsigned int toccami_latency_bucket(s64 ns) {
+  return min_t(unsigned int, fls64(max_t(s64, ns, 0)), LATENCY_BUCKETS - 1);
+}
 
-  printk(KERN_INFO "toccami: Starting init procedure\n");
+static void toccami_stats_show_histogram(struct seq_file *s, const char *name,
+                                         const u64 *histogram) {
+  int i;
 
-  toccamiInput = input_allocate_device();
-  if (!toccamiInput)
+  seq_printf(s, "%s:\n", name);
+  for (i = 0; i < LATENCY_BUCKETS; i++)
+    if (histogram[i])
+      seq_printf(s, "  %s%llu ns: %llu\n",
+                 i == LATENCY_BUCKETS - 1 ? ">=" : "<",
+                 i == LATENCY_BUCKETS - 1 ? 1ULL << (i - 1) : 1ULL << i,
+                 histogram[i]);
+}
+
+// Sum the per-CPU counters of a device, without the histograms
+static void toccami_device_counters(struct toccami_device *device,
+                                    struct toccami_counters *counters) {
+  struct toccami_stats *cpuStats;
+  int cpu;
+
+  memset(counters, 0, sizeof(*counters));
+  for_each_possible_cpu(cpu) {
+    cpuStats = per_cpu_ptr(device->stats, cpu);
+    counters->records += cpuStats->records;
+    counters->frames += cpuStats->frames;
+    counters->bytes += cpuStats->bytes;
+    counters->invalidSize += cpuStats->invalidSize;
+    counters->faults += cpuStats->faults;
+    counters->dropped += cpuStats->dropped;
+    counters->coalesced += cpuStats->coalesced;
+    counters->watchdog += cpuStats->watchdog;
+    counters->udpDropped += cpuStats->udpDropped;
+  }
+}
+
+/** @brief Show the per-CPU statistics of a device summed up: rates are
+ * obtained by reading the file twice
+ */
+static int toccami_stats_show(struct seq_file *s, void *unused) {
+  struct toccami_device *device = s->private;
+  struct toccami_stats *cpuStats, *total;
+  struct toccami_counters counters;
+  int cpu, i;
+
+  total = kzalloc(sizeof(*total), GFP_KERNEL);
+  if (!total)
+    return -ENOMEM;
+
+  for_each_possible_cpu(cpu) {
+    cpuStats = per_cpu_ptr(device->stats, cpu);
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+      total->writeLatency[i] += cpuStats->writeLatency[i];
+      total->syncLatency[i] += cpuStats->syncLatency[i];
+    }
+  }
+  toccami_device_counters(device, &counters);
+
+  seq_printf(s, "records: %llu\n", counters.records);
+  seq_printf(s, "frames: %llu\n", counters.frames);
+  seq_printf(s, "bytes: %llu\n", counters.bytes);
+  seq_printf(s, "invalid_size: %llu\n", counters.invalidSize);
+  seq_printf(s, "faults: %llu\n", counters.faults);
+  seq_printf(s, "dropped: %llu\n", counters.dropped);
+  seq_printf(s, "coalesced: %llu\n", counters.coalesced);
+  seq_printf(s, "watchdog: %llu\n", counters.watchdog);
+  seq_printf(s, "udp_dropped: %llu\n", counters.udpDropped);
+  toccami_stats_show_histogram(s, "write_latency", total->writeLatency);
+  toccami_stats_show_histogram(s, "sync_latency", total->syncLatency);
+
+  kfree(total);
+  return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(toccami_stats);
+
+// Entries of a capture ring copied when its debugfs file is opened, the trace
+// starts at entries[start]
+struct toccami_capture_snapshot {
+  size_t start;
+  size_t size;
+  struct toccami_capture_entry entries[];
+};
+
+// Capture entries copied per hold of captureLock
+#define CAPTURE_COPY_CHUNK 1024
+
+/** @brief Copy the capture ring of a device, so that a slow reader sees a
+ * consistent trace while records keep coming. The copy goes backwards from
+ * the head seen at open in chunks, so the producers are not held off for the
+ * whole ring, and stops at the oldest entry not overwritten meanwhile.
+ */
+static int toccami_capture_open(struct inode *inode, struct file *file) {
+  struct toccami_device *device = inode->i_private;
+  struct toccami_capture_snapshot *snapshot;
+  u32 mask = device->captureSize - 1, chunk, i;
+  u64 head, first, oldest, pos;
+
+  snapshot = kvmalloc(struct_size(snapshot, entries, device->captureSize),
+                      GFP_KERNEL);
+  if (!snapshot)
+    return -ENOMEM;
+
+  spin_lock(&device->captureLock);
+  head = device->captureHead;
+  spin_unlock(&device->captureLock);
+
+  first = head - min_t(u64, head, device->captureSize);
+  pos = head;
+  while (pos > first) {
+    chunk = min_t(u64, pos - first, CAPTURE_COPY_CHUNK);
+
+    spin_lock(&device->captureLock);
+    oldest = device->captureHead - min_t(u64, device->captureHead,
+                                         device->captureSize);
+    if (pos - chunk < oldest)
+      chunk = pos > oldest ? pos - oldest : 0;
+    for (i = 0; i < chunk; i++)
+      snapshot->entries[pos - chunk + i - first] =
+          device->capture[(pos - chunk + i) & mask];
+    spin_unlock(&device->captureLock);
+
+    // Older entries were overwritten since the open
+    pos -= chunk;
+    if (pos <= oldest)
+      break;
+    cond_resched();
+  }
+
+  snapshot->start = pos - first;
+  snapshot->size = (head - pos) * sizeof(struct toccami_capture_entry);
+  file->private_data = snapshot;
+  return 0;
+}
+
+static ssize_t toccami_capture_read(struct file *file, char __user *buffer,
+                                    size_t len, loff_t *offset) {
+  struct toccami_capture_snapshot *snapshot = file->private_data;
+
+  return simple_read_from_buffer(buffer, len, offset,
+                                 snapshot->entries + snapshot->start,
+                                 snapshot->size);
+}
+
+static int toccami_capture_release(struct inode *inode, struct file *file) {
+  kvfree(file->private_data);
+  return 0;
+}
+
+static const struct file_operations toccami_capture_fops = {
+    .owner = THIS_MODULE,
+    .open = toccami_capture_open,
+    .read = toccami_capture_read,
+    .release = toccami_capture_release,
+    .llseek = default_llseek,
+};
+
+// Append a record to the capture ring, with device->captureLock held
+static void toccami_capture_store(struct toccami_device *device, u64 ns,
+                                  struct toccami_record record) {
+  struct toccami_capture_entry *entry =
+      &device->capture[device->captureHead++ & (device->captureSize - 1)];
+
+  entry->ns = ns;
+  entry->x = record.x;
+  entry->y = record.y;
+  entry->pointerIndex = record.pointerIndex;
+  entry->eventType = record.eventType;
+}
+
+/** @brief Append records accepted from a producer to the capture ring of a
+ * device, if it has one. Producers of the same device may race here
+ */
+static void toccami_capture(struct toccami_device *device,
+                            const struct toccami_record *records,
+                            unsigned int count) {
+  unsigned int i;
+  u64 ns;
+
+  if (!device->capture)
+    return;
+
+  ns = ktime_get_ns();
+  spin_lock(&device->captureLock);
+  for (i = 0; i < count; i++)
+    toccami_capture_store(device, ns, records[i]);
+  spin_unlock(&device->captureLock);
+}
+
+// Same as toccami_capture for the records of a shared ring
+static void toccami_capture_events(struct toccami_device *device,
+                                   const struct toccami_event *events,
+                                   unsigned int count) {
+  unsigned int i;
+  u64 ns;
+
+  if (!device->capture)
+    return;
+
+  ns = ktime_get_ns();
+  spin_lock(&device->captureLock);
+  for (i = 0; i < count; i++)
+    toccami_capture_store(device, ns, toccami_record_from_event(&events[i]));
+  spin_unlock(&device->captureLock);
+}
+
+// Tell the readers of a device that its state changed
+static void toccami_device_status_changed(struct toccami_device *device) {
+  atomic_inc(&device->statusSequence);
+  wake_up_interruptible(&device->readWait);
+}
+
+// First open of the gestures device, see toccami_input_open
+static int toccami_gestures_open(struct input_dev *dev) {
+  struct toccami_device *device = input_get_drvdata(dev);
+
+  WRITE_ONCE(device->gesturesOpen, true);
+  toccami_device_status_changed(device);
+  return 0;
+}
+
+// Last close of the gestures device
+static void toccami_gestures_close(struct input_dev *dev) {
+  struct toccami_device *device = input_get_drvdata(dev);
+
+  WRITE_ONCE(device->gesturesOpen, false);
+  toccami_device_status_changed(device);
+}
+
+/** @brief Register the companion device reporting the gestures of a touchpad
+ */
+static int toccami_gestures_create(struct toccami_device *device) {
+  struct input_dev *gesturesInput;
+  int ret;
+
+  gesturesInput = input_allocate_device();
+  if (!gesturesInput)
+    return -ENOMEM;
+
+  snprintf(device->gesturesPhys, sizeof(device->gesturesPhys), "%s/gestures",
+           device->phys);
+  gesturesInput->name = "Toccami Gestures";
+  gesturesInput->phys = device->gesturesPhys;
+
+  input_set_capability(gesturesInput, EV_KEY, BTN_LEFT);
+  input_set_capability(gesturesInput, EV_KEY, BTN_RIGHT);
+  input_set_capability(gesturesInput, EV_KEY, BTN_MIDDLE);
+  input_set_capability(gesturesInput, EV_KEY, KEY_ZOOMIN);
+  input_set_capability(gesturesInput, EV_KEY, KEY_ZOOMOUT);
+  input_set_capability(gesturesInput, EV_REL, REL_WHEEL);
+  input_set_capability(gesturesInput, EV_REL, REL_HWHEEL);
+  // Never reported, they make udev and libinput handle it as a mouse
+  input_set_capability(gesturesInput, EV_REL, REL_X);
+  input_set_capability(gesturesInput, EV_REL, REL_Y);
+
+  input_set_drvdata(gesturesInput, device);
+  gesturesInput->open = toccami_gestures_open;
+  gesturesInput->close = toccami_gestures_close;
+
+  ret = input_register_device(gesturesInput);
+  if (ret) {
+    input_free_device(gesturesInput);
+    return ret;
+  }
+
+  device->gestures = gesturesInput;
+  return 0;
+}
+
+/** @brief Register the companion tablet device of a touchpad, on the same
+ * axes
+ */
+static int toccami_pen_create(struct toccami_device *device, unsigned int xMax,
+                              unsigned int yMax, unsigned int xRes,
+                              unsigned int yRes) {
+  struct input_dev *penInput;
+  int ret;
+
+  penInput = input_allocate_device();
+  if (!penInput)
     return -ENOMEM;
 
-  __clear_bit(EV_MSC, toccamiInput->evbit);
+  snprintf(device->penPhys, sizeof(device->penPhys), "%s/pen", device->phys);
+  penInput->name = "Toccami Pen";
+  penInput->phys = device->penPhys;
+
+  input_set_capability(penInput, EV_KEY, BTN_TOOL_PEN);
+  input_set_capability(penInput, EV_KEY, BTN_TOOL_RUBBER);
+  input_set_capability(penInput, EV_KEY, BTN_TOUCH);
+  input_set_capability(penInput, EV_KEY, BTN_STYLUS);
+  input_set_capability(penInput, EV_KEY, BTN_STYLUS2);
+  __set_bit(INPUT_PROP_POINTER, penInput->propbit);
+
+  input_set_abs_params(penInput, ABS_X, AXIS_X_MIN, xMax, 0, 0);
+  input_set_abs_params(penInput, ABS_Y, AXIS_Y_MIN, yMax, 0, 0);
+  input_abs_set_res(penInput, ABS_X, xRes);
+  input_abs_set_res(penInput, ABS_Y, yRes);
+  input_set_abs_params(penInput, ABS_PRESSURE, 0, TOCCAMI_PEN_PRESSURE, 0, 0);
+  input_set_abs_params(penInput, ABS_TILT_X, -90, 90, 0, 0);
+  input_set_abs_params(penInput, ABS_TILT_Y, -90, 90, 0, 0);
+  // Units per radian, tilts are in degrees
+  input_abs_set_res(penInput, ABS_TILT_X, 57);
+  input_abs_set_res(penInput, ABS_TILT_Y, 57);
+  input_set_abs_params(penInput, ABS_DISTANCE, 0, U8_MAX, 0, 0);
+
+  ret = input_register_device(penInput);
+  if (ret) {
+    input_free_device(penInput);
+    return ret;
+  }
+
+  device->pen = penInput;
+  return 0;
+}
+
+/** @brief Memoryless force feedback callback, runs in timer context: keep the
+ * magnitudes for the readers of the device
+ */
+static int toccami_ff_play(struct input_dev *dev, void *data,
+                           struct ff_effect *effect) {
+  struct toccami_device *device = data;
+  unsigned long flags;
+
+  spin_lock_irqsave(&device->ffLock, flags);
+  device->ffStrong = effect->u.rumble.strong_magnitude;
+  device->ffWeak = effect->u.rumble.weak_magnitude;
+  spin_unlock_irqrestore(&device->ffLock, flags);
+
+  atomic_inc(&device->ffSequence);
+  wake_up_interruptible(&device->readWait);
+  return 0;
+}
+
+/** @brief First open of the input device. Only the next work notices, the
+ * work is not queued from the input callbacks because closing races with
+ * toccami_device_destroy
+ */
+static int toccami_input_open(struct input_dev *dev) {
+  struct toccami_device *device = input_get_drvdata(dev);
+
+  WRITE_ONCE(device->inputOpen, true);
+  toccami_device_status_changed(device);
+  return 0;
+}
+
+// Last close of the input device
+static void toccami_input_close(struct input_dev *dev) {
+  struct toccami_device *device = input_get_drvdata(dev);
+
+  WRITE_ONCE(device->inputOpen, false);
+  toccami_device_status_changed(device);
+}
+
+// Someone reads the contacts, or the gestures made from them
+static bool toccami_device_open(struct toccami_device *device) {
+  return READ_ONCE(device->inputOpen) || READ_ONCE(device->gesturesOpen);
+}
+
+/** @brief Allocate and register a new virtual touchpad
+ *  @return The device or an ERR_PTR
+ */
+static struct toccami_device *toccami_device_create(void) {
+  struct toccami_device *device;
+  struct input_dev *toccamiInput;
+  unsigned int xMax, yMax, xRes, yRes, eventsPerPacket, outputRate;
+  unsigned int captureRecords;
+  int ret;
+
+  xMax = clamp_val(READ_ONCE(axis_x_max), 1, U16_MAX);
+  yMax = clamp_val(READ_ONCE(axis_y_max), 1, U16_MAX);
+  xRes = READ_ONCE(resolution_x);
+  yRes = READ_ONCE(resolution_y);
+
+  device = kzalloc(sizeof(*device), GFP_KERNEL);
+  if (!device)
+    return ERR_PTR(-ENOMEM);
+
+  device->numSlots = clamp_val(READ_ONCE(max_touches), 1, MAX_TOUCHES_LIMIT);
+  device->contactAttrs = READ_ONCE(contact_attrs);
+  device->idle = true;
+  outputRate = min_t(unsigned int, READ_ONCE(output_rate), MAX_OUTPUT_RATE);
+  if (outputRate) {
+    device->outputPeriodNs = div_u64(NSEC_PER_SEC, outputRate);
+    device->resampleDelayNs = (u64)READ_ONCE(resample_delay_us) * NSEC_PER_USEC;
+  }
+  device->predictNs =
+      (u64)min_t(unsigned int, READ_ONCE(predict_ms), MAX_PREDICT_MS) *
+      NSEC_PER_MSEC;
+  eventsPerPacket = READ_ONCE(events_per_packet);
+  if (!eventsPerPacket)
+    eventsPerPacket =
+        device->numSlots *
+            (EVENTS_PER_CONTACT +
+             (device->contactAttrs ? EVENTS_PER_CONTACT_ATTRS : 0)) +
+        EVENTS_PER_FRAME;
+
+  device->slots =
+      kcalloc(device->numSlots, sizeof(struct toccami_slot), GFP_KERNEL);
+  device->busySlots = bitmap_zalloc(device->numSlots, GFP_KERNEL);
+  if (!device->slots || !device->busySlots) {
+    ret = -ENOMEM;
+    goto err_slots;
+  }
+
+  device->stats = alloc_percpu(struct toccami_stats);
+  if (!device->stats) {
+    ret = -ENOMEM;
+    goto err_slots;
+  }
+
+  device->id = ida_alloc_max(&toccamiIda, MAX_DEVICES - 1, GFP_KERNEL);
+  if (device->id < 0) {
+    ret = device->id;
+    goto err_stats;
+  }
+
+  captureRecords = min_t(unsigned int, READ_ONCE(capture_records),
+                         MAX_CAPTURE_RECORDS);
+  if (captureRecords) {
+    device->captureSize = roundup_pow_of_two(captureRecords);
+    device->capture = vmalloc(array_size(device->captureSize,
+                                         sizeof(struct toccami_capture_entry)));
+    if (!device->capture) {
+      ret = -ENOMEM;
+      goto err_table;
+    }
+  }
+  spin_lock_init(&device->captureLock);
+
+  mutex_init(&device->lock);
+  INIT_LIST_HEAD(&device->clients);
+  INIT_WORK(&device->work, toccami_device_work);
+  hrtimer_init(&device->watchdog, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+  device->watchdog.function = toccami_device_watchdog;
+  hrtimer_init(&device->resampleTimer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+  device->resampleTimer.function = toccami_device_resample_tick;
+  init_waitqueue_head(&device->readWait);
+  spin_lock_init(&device->ffLock);
+  snprintf(device->phys, sizeof(device->phys), "toccami/input%d", device->id);
+
+  toccamiInput = input_allocate_device();
+  if (!toccamiInput) {
+    ret = -ENOMEM;
+    goto err_table;
+  }
+  device->input = toccamiInput;
+
+  if (hw_timestamps)
+    input_set_capability(toccamiInput, EV_MSC, MSC_TIMESTAMP);
+  else
+    __clear_bit(EV_MSC, toccamiInput->evbit);
   __clear_bit(ABS_TOOL_WIDTH, toccamiInput->absbit);
   __clear_bit(BTN_0, toccamiInput->keybit);
   __clear_bit(BTN_RIGHT, toccamiInput->keybit);
@@ -76,51 +1040,178 @@ static int __init toccami_init(void) {
 
   __set_bit(EV_ABS, toccamiInput->evbit);
 
-  if (input_mt_init_slots(toccamiInput, MAX_TOUCHES,
-                          INPUT_MT_POINTER | INPUT_MT_DROP_UNUSED |
-                              INPUT_MT_TRACK)) {
+  if (input_mt_init_slots(toccamiInput, device->numSlots,
+                          INPUT_MT_POINTER)) {
     printk(KERN_ERR "toccami: Error allocating slots\n");
-    return -ENOMEM;
+    ret = -ENOMEM;
+    goto err_input;
   }
 
-  input_set_abs_params(toccamiInput, ABS_X, AXIS_X_MIN, AXIS_X_MAX, 0, 0);
-  input_set_abs_params(toccamiInput, ABS_Y, AXIS_Y_MIN, AXIS_Y_MAX, 0, 0);
+  input_set_abs_params(toccamiInput, ABS_X, AXIS_X_MIN, xMax, 0, 0);
+  input_set_abs_params(toccamiInput, ABS_Y, AXIS_Y_MIN, yMax, 0, 0);
+
+  input_set_abs_params(toccamiInput, ABS_MT_POSITION_X, AXIS_X_MIN, xMax, 0, 0);
+  input_set_abs_params(toccamiInput, ABS_MT_POSITION_Y, AXIS_Y_MIN, yMax, 0, 0);
 
-  input_set_abs_params(toccamiInput, ABS_MT_POSITION_X, AXIS_X_MIN, AXIS_X_MAX,
-                       0, 0);
-  input_set_abs_params(toccamiInput, ABS_MT_POSITION_Y, AXIS_Y_MIN, AXIS_Y_MAX,
-                       0, 0);
+  input_abs_set_res(toccamiInput, ABS_X, xRes);
+  input_abs_set_res(toccamiInput, ABS_Y, yRes);
+  input_abs_set_res(toccamiInput, ABS_MT_POSITION_X, xRes);
+  input_abs_set_res(toccamiInput, ABS_MT_POSITION_Y, yRes);
 
-  input_abs_set_res(toccamiInput, ABS_X, TEMP_RESOLUTION_X);
-  input_abs_set_res(toccamiInput, ABS_Y, TEMP_RESOLUTION_Y);
-  input_abs_set_res(toccamiInput, ABS_MT_POSITION_X, TEMP_RESOLUTION_X);
-  input_abs_set_res(toccamiInput, ABS_MT_POSITION_Y, TEMP_RESOLUTION_Y);
+  if (device->contactAttrs) {
+    input_set_abs_params(toccamiInput, ABS_MT_PRESSURE, 0, U8_MAX, 0, 0);
+    input_set_abs_params(toccamiInput, ABS_PRESSURE, 0, U8_MAX, 0, 0);
+    input_set_abs_params(toccamiInput, ABS_MT_TOUCH_MAJOR, 0, U8_MAX, 0, 0);
+    input_set_abs_params(toccamiInput, ABS_MT_TOUCH_MINOR, 0, U8_MAX, 0, 0);
+    input_set_abs_params(toccamiInput, ABS_MT_ORIENTATION, -S8_MAX, S8_MAX, 0,
+                         0);
+    input_abs_set_res(toccamiInput, ABS_MT_TOUCH_MAJOR, xRes);
+    input_abs_set_res(toccamiInput, ABS_MT_TOUCH_MINOR, xRes);
+  }
+
+  input_set_events_per_packet(toccamiInput, eventsPerPacket);
 
-  input_set_events_per_packet(toccamiInput, EVENT_PER_PACKET);
+  if (READ_ONCE(force_feedback)) {
+    // The call below compiles away without ff-memless, so that the module
+    // still loads when force feedback is not asked for
+    if (!IS_ENABLED(CONFIG_INPUT_FF_MEMLESS)) {
+      printk(KERN_ERR "toccami: force_feedback needs "
+                      "CONFIG_INPUT_FF_MEMLESS\n");
+      ret = -EOPNOTSUPP;
+      goto err_input;
+    }
+    input_set_capability(toccamiInput, EV_FF, FF_RUMBLE);
+    ret = input_ff_create_memless(toccamiInput, device, toccami_ff_play);
+    if (ret)
+      goto err_input;
+  }
 
   toccamiInput->name = "Toccami Driver";
-  toccamiInput->phys = "toccami/input0";
+  toccamiInput->phys = device->phys;
+  toccamiInput->open = toccami_input_open;
+  toccamiInput->close = toccami_input_close;
+  input_set_drvdata(toccamiInput, device);
 
   if (input_register_device(toccamiInput)) {
-    input_free_device(toccamiInput);
-    return -EINVAL;
+    ret = -EINVAL;
+    goto err_input;
+  }
+
+  if (READ_ONCE(gestures)) {
+    ret = toccami_gestures_create(device);
+    if (ret)
+      goto err_unregister;
+  }
+
+  if (READ_ONCE(pen)) {
+    ret = toccami_pen_create(device, xMax, yMax, xRes, yRes);
+    if (ret)
+      goto err_gestures;
+  }
+
+  device->debugfsDir =
+      debugfs_create_dir(device->phys + strlen("toccami/"), toccamiDebugfs);
+  debugfs_create_file("stats", 0444, device->debugfsDir, device,
+                      &toccami_stats_fops);
+  if (device->capture)
+    debugfs_create_file("capture", 0400, device->debugfsDir, device,
+                        &toccami_capture_fops);
+
+  mutex_lock(&toccamiDevicesLock);
+  list_add_tail(&device->node, &toccamiDevices);
+  mutex_unlock(&toccamiDevicesLock);
+
+  return device;
+
+err_gestures:
+  if (device->gestures)
+    input_unregister_device(device->gestures);
+err_unregister:
+  input_unregister_device(toccamiInput);
+  toccamiInput = NULL;
+err_input:
+  input_free_device(toccamiInput);
+err_table:
+  mutex_destroy(&device->lock);
+  vfree(device->capture);
+  ida_free(&toccamiIda, device->id);
+err_stats:
+  free_percpu(device->stats);
+err_slots:
+  bitmap_free(device->busySlots);
+  kfree(device->slots);
+  kfree(device);
+  return ERR_PTR(ret);
+}
+
+// The device must not have clients anymore
+static void toccami_device_destroy(struct toccami_device *device) {
+  mutex_lock(&toccamiDevicesLock);
+  list_del(&device->node);
+  mutex_unlock(&toccamiDevicesLock);
+
+  debugfs_remove_recursive(device->debugfsDir);
+  // Clients released their contacts when detaching, the work cannot arm the
+  // watchdog again
+  hrtimer_cancel(&device->resampleTimer);
+  hrtimer_cancel(&device->watchdog);
+  cancel_work_sync(&device->work);
+  if (device->pen)
+    input_unregister_device(device->pen);
+  if (device->gestures)
+    input_unregister_device(device->gestures);
+  input_unregister_device(device->input);
+  mutex_destroy(&device->lock);
+  vfree(device->capture);
+  ida_free(&toccamiIda, device->id);
+  free_percpu(device->stats);
+  bitmap_free(device->busySlots);
+  kfree(device->slots);
+  kfree(device);
+}
+
+static int __init toccami_init(void) {
+  int ret;
+
+  printk(KERN_INFO "toccami: Starting init procedure\n");
+
+  max_write_records = clamp_val(max_write_records, 1, MAX_WRITE_RECORDS_LIMIT);
+  max_pointer_id = clamp_val(max_pointer_id, 1, MAX_POINTER_ID_LIMIT);
+  // A write and its trailing separator must always fit in the queue
+  queue_records = max(queue_records, max_write_records + 1);
+
+  toccamiWq = alloc_workqueue("toccami", WQ_HIGHPRI, 0);
+  if (!toccamiWq)
+    return -ENOMEM;
+
+  toccamiDebugfs = debugfs_create_dir(CLASS_NAME, NULL);
+
+  toccamiDefault = toccami_device_create();
+  if (IS_ERR(toccamiDefault)) {
+    debugfs_remove_recursive(toccamiDebugfs);
+    destroy_workqueue(toccamiWq);
+    return PTR_ERR(toccamiDefault);
   }
 
-  mutex_init(&toccamiMutex);
+  ret = register_pm_notifier(&toccamiPmNotifier);
+  if (ret)
+    goto err_pm;
 
   majorNumber = register_chrdev(0, DEVICE_NAME, &fops);
   if (majorNumber < 0) {
     printk(KERN_ALERT "Toccami failed to register a major number\n");
-    return majorNumber;
+    ret = majorNumber;
+    goto err_device;
   }
 
   toccamiClass = class_create(THIS_MODULE, CLASS_NAME);
-  toccamiClass->dev_uevent = toccami_device_777_permission;
   if (IS_ERR(toccamiClass)) {
     unregister_chrdev(majorNumber, DEVICE_NAME);
     printk(KERN_ALERT "Toccami: Failed to register device class\n");
-    return PTR_ERR(toccamiClass);
+    ret = PTR_ERR(toccamiClass);
+    goto err_device;
   }
+  toccamiClass->dev_uevent = toccami_device_777_permission;
 
   toccamiDevice = device_create(toccamiClass, NULL, MKDEV(majorNumber, 0), NULL,
                                 DEVICE_NAME);
@@ -128,127 +1219,2230 @@ static int __init toccami_init(void) {
     class_destroy(toccamiClass);
     unregister_chrdev(majorNumber, DEVICE_NAME);
     printk(KERN_ALERT "Toccami: Failed to create the device\n");
-    return PTR_ERR(toccamiDevice);
+    ret = PTR_ERR(toccamiDevice);
+    goto err_device;
   }
 
   printk(KERN_INFO "toccami: Successful init procedure, ready to use\n");
 
   return 0;
+
+err_device:
+  unregister_pm_notifier(&toccamiPmNotifier);
+err_pm:
+  toccami_device_destroy(toccamiDefault);
+  debugfs_remove_recursive(toccamiDebugfs);
+  destroy_workqueue(toccamiWq);
+  return ret;
 }
 
 static void __exit toccami_exit(void) {
 
-  input_unregister_device(toccamiInput);
-
-  mutex_destroy(&toccamiMutex);
-
   device_destroy(toccamiClass, MKDEV(majorNumber, 0));
   class_unregister(toccamiClass);
   class_destroy(toccamiClass);
   unregister_chrdev(majorNumber, DEVICE_NAME);
+  unregister_pm_notifier(&toccamiPmNotifier);
+
+  // Private devices are gone with their clients, the module is not in use
+  toccami_device_destroy(toccamiDefault);
+  ida_destroy(&toccamiIda);
+  debugfs_remove_recursive(toccamiDebugfs);
+  destroy_workqueue(toccamiWq);
 
   printk(KERN_INFO "Toccami: Goodbye from the LKM!\n");
 }
 
-static int dev_open(struct inode *inodep, struct file *filep) {
-  if (!mutex_trylock(&toccamiMutex)) {
-    printk(KERN_ALERT "Toccami: Device in use by another process");
-    return -EBUSY;
-  }
-  numberOpens++;
-  printk(KERN_INFO "Toccami: Device has been opened %d time(s)\n", numberOpens);
-  return 0;
+static void toccami_device_attach(struct toccami_device *device,
+                                  struct toccami_client *client) {
+  mutex_lock(&device->lock);
+  client->device = device;
+  list_add_tail(&client->node, &device->clients);
+  mutex_unlock(&device->lock);
 }
 
-/** @brief This function is called whenever device is being read from user space
- * i.e. data is being sent from the device to the user. In this case is uses the
- * copy_to_user() function to send the buffer string to the user and captures
- * any errors.
- *  @param filep A pointer to a file object (defined in linux/fs.h)
- *  @param buffer The pointer to the buffer to which this function writes the
- * data
- *  @param len The length of the b
- *  @param offset The offset if required
- */
-static ssize_t dev_read(struct file *filep, char *buffer, size_t len,
-                        loff_t *offset) {
-  return -EINVAL;
-}
+// Report what the client queued so far and remove it from its device
+static void toccami_device_detach(struct toccami_client *client) {
+  struct toccami_device *device = client->device;
 
-#define TOCCAMI_EVENT_RELEASED 0
-#define TOCCAMI_EVENT_DOWN 1
-#define TOCCAMI_EVENT_CHANGE_RESOLUTION 2
+  queue_work(toccamiWq, &device->work);
+  flush_work(&device->work);
 
-#define TOCCAMI_EVENT_LENGTH 8
+  mutex_lock(&device->lock);
+  list_del(&client->node);
+  toccami_device_release(device, client);
+  mutex_unlock(&device->lock);
+}
 
-static ssize_t dev_write(struct file *filep, const char *buffer, size_t len,
-                         loff_t *offset) {
-  unsigned int i, touchCount;
-  u16 x, y, pointerIndex, eventType;
-  char kernelBuffer[TOCCAMI_EVENT_LENGTH];
+/** @brief Every open file is a new client of the shared touchpad, it can get
+ * a private one with TOCCAMI_IOC_DEV_CREATE
+ */
+static int dev_open(struct inode *inodep, struct file *filep) {
+  struct toccami_client *client;
+
+  client = kzalloc(sizeof(*client), GFP_KERNEL);
+  if (!client)
+    return -ENOMEM;
+
+  // One more record for the separator closing every write
+  client->staging = kmalloc_array(max_write_records + 1,
+                                  sizeof(struct toccami_record), GFP_KERNEL);
+  if (!client->staging)
+    goto err_client;
+
+  client->slotByPointer = kvmalloc(max_pointer_id, GFP_KERNEL);
+  if (!client->slotByPointer)
+    goto err_staging;
+  memset(client->slotByPointer, NO_SLOT, max_pointer_id);
+
+  if (kfifo_alloc(&client->queue, queue_records, GFP_KERNEL))
+    goto err_table;
+
+  mutex_init(&client->lock);
+  INIT_WORK(&client->udpWork, toccami_udp_work);
+  spin_lock_init(&client->queueLock);
+  init_waitqueue_head(&client->queueWait);
+  // The first read returns the current status
+  atomic_set(&client->statusSeen,
+             atomic_read(&toccamiDefault->statusSequence) - 1);
+  atomic_set(&client->ffSeen, atomic_read(&toccamiDefault->ffSequence));
+  toccami_device_attach(toccamiDefault, client);
+  filep->private_data = client;
+  // dev_write_iter honors IOCB_NOWAIT, io_uring can submit inline
+  filep->f_mode |= FMODE_NOWAIT;
+
+  printk(KERN_INFO "Toccami: Device has been opened %d time(s)\n",
+         atomic_inc_return(&numberOpens));
+  return 0;
+
+err_table:
+  kvfree(client->slotByPointer);
+err_staging:
+  kfree(client->staging);
+err_client:
+  kfree(client);
+  return -ENOMEM;
+}
+
+// Axes of a device, as seen by readers of absinfo
+static void toccami_device_get_axes(struct toccami_device *device,
+                                    struct toccami_axes *axes) {
+  struct input_dev *toccamiInput = device->input;
+
+  spin_lock_irq(&toccamiInput->event_lock);
+  axes->xMax = input_abs_get_max(toccamiInput, ABS_MT_POSITION_X);
+  axes->yMax = input_abs_get_max(toccamiInput, ABS_MT_POSITION_Y);
+  axes->xResolution = input_abs_get_res(toccamiInput, ABS_MT_POSITION_X);
+  axes->yResolution = input_abs_get_res(toccamiInput, ABS_MT_POSITION_Y);
+  spin_unlock_irq(&toccamiInput->event_lock);
+}
+
+// A message of the device of the client has not been read yet
+static bool toccami_client_readable(struct toccami_client *client) {
+  struct toccami_device *device = READ_ONCE(client->device);
+
+  return atomic_read(&device->statusSequence) !=
+             atomic_read(&client->statusSeen) ||
+         atomic_read(&device->ffSequence) != atomic_read(&client->ffSeen);
+}
+
+// Snapshot of the state of the device of a client, taken without device->lock
+static void toccami_client_status(struct toccami_client *client,
+                                  struct toccami_status *status) {
+  struct toccami_device *device = client->device;
+  struct toccami_counters counters;
+
+  status->activeSlots = READ_ONCE(device->activeMask);
+  if (!toccami_device_open(device))
+    status->flags |= TOCCAMI_STATUS_IDLE;
+  if (READ_ONCE(device->quiesce))
+    status->flags |= TOCCAMI_STATUS_DRAINING;
+  toccami_device_counters(device, &counters);
+  status->dropped = counters.dropped + counters.udpDropped;
+  status->coalesced = counters.coalesced;
+  toccami_device_get_axes(device, &status->axes);
+
+  status->queued = kfifo_len(&client->queue);
+  if (smp_load_acquire(&client->ring))
+    status->queued += smp_load_acquire(&client->ringHead) -
+                      smp_load_acquire(&client->ringTail);
+}
+
+/** @brief Read the messages of the device of the client: the rumble first,
+ * then the status. Each message is only returned to one reader, with the
+ * state at the time of the read
+ *  @return The size of the messages, or -EINVAL if none fits, -EAGAIN,
+ * -EFAULT
+ */
+static ssize_t dev_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+  struct toccami_client *client = iocb->ki_filp->private_data;
+  struct toccami_message message;
+  struct toccami_device *device;
+  unsigned long flags;
+  size_t room = iov_iter_count(to) / sizeof(message);
+  ssize_t len = 0;
+  int sequence;
+
+  if (!room)
+    return -EINVAL;
+
+again:
+  while (!toccami_client_readable(client)) {
+    if ((iocb->ki_filp->f_flags & O_NONBLOCK) ||
+        (iocb->ki_flags & IOCB_NOWAIT))
+      return -EAGAIN;
+    if (wait_event_interruptible(READ_ONCE(client->device)->readWait,
+                                 toccami_client_readable(client)))
+      return -ERESTARTSYS;
+  }
+
+  device = READ_ONCE(client->device);
+
+  sequence = atomic_read(&device->ffSequence);
+  if (atomic_xchg(&client->ffSeen, sequence) != sequence) {
+    memset(&message, 0, sizeof(message));
+    message.type = TOCCAMI_MESSAGE_RUMBLE;
+    spin_lock_irqsave(&device->ffLock, flags);
+    message.rumble.strong = device->ffStrong;
+    message.rumble.weak = device->ffWeak;
+    spin_unlock_irqrestore(&device->ffLock, flags);
+
+    if (copy_to_iter(&message, sizeof(message), to) != sizeof(message))
+      return -EFAULT;
+    len += sizeof(message);
+    room--;
+  }
+
+  sequence = atomic_read(&device->statusSequence);
+  if (room && atomic_xchg(&client->statusSeen, sequence) != sequence) {
+    memset(&message, 0, sizeof(message));
+    message.type = TOCCAMI_MESSAGE_STATUS;
+    toccami_client_status(client, &message.status);
+
+    if (copy_to_iter(&message, sizeof(message), to) != sizeof(message))
+      return len ? len : -EFAULT;
+    len += sizeof(message);
+  }
+
+  // Another reader took the messages
+  if (!len) {
+    if ((iocb->ki_filp->f_flags & O_NONBLOCK) ||
+        (iocb->ki_flags & IOCB_NOWAIT))
+      return -EAGAIN;
+    goto again;
+  }
+  return len;
+}
+
+/** @brief Stamp the current frame with the producer capture time.
+ * The offset between the two clocks is the smallest arrival - capture
+ * difference seen so far, i.e. the one with the least network delay, slowly
+ * pulled up to follow clock drift. It is reset when the capture clock goes
+ * backward, e.g. when the producer restarts.
+ *  @param sourceUs Capture time in microseconds, producer clock
+ */
+static void toccami_set_frame_timestamp(struct toccami_client *client,
+                                        u64 sourceUs) {
+  struct input_dev *toccamiInput = client->device->input;
+  s64 now = ktime_to_ns(ktime_get());
+  s64 sourceNs = sourceUs * NSEC_PER_USEC;
+  s64 offset = now - sourceNs;
+
+  if (!client->clockValid || sourceUs < client->clockLastUs ||
+      offset < client->clockOffset) {
+    client->clockOffset = offset;
+    client->clockValid = true;
+  } else {
+    client->clockOffset += (offset - client->clockOffset) >> 10;
+  }
+  client->clockLastUs = sourceUs;
+
+  client->device->frameTimestamp = min(sourceNs + client->clockOffset, now);
+
+  // Resampled frames are reported later by the output clock, a timestamp set
+  // here would stick to whichever frame it syncs next
+  if (client->device->outputPeriodNs)
+    return;
+
+  input_set_timestamp(toccamiInput,
+                      ns_to_ktime(client->device->frameTimestamp));
+
+  if (hw_timestamps)
+    input_event(toccamiInput, EV_MSC, MSC_TIMESTAMP, (u32)sourceUs);
+}
+
+/** @brief Find the slot of a pointer of a client in constant time.
+ *  @param allocate Give a free slot to a pointer that is not down, a slot
+ * released by the current frame is never used again before the next one
+ *  @return The slot index or -1
+ */
+static int toccami_slot_lookup(struct toccami_device *device,
+                               struct toccami_client *client, u16 pointerIndex,
+                               bool allocate) {
+  int slotIndex;
+
+  if (pointerIndex >= max_pointer_id)
+    return -1;
+
+  slotIndex = client->slotByPointer[pointerIndex];
+  if (slotIndex != NO_SLOT)
+    return slotIndex;
+  if (!allocate)
+    return -1;
+
+  slotIndex = find_first_zero_bit(device->busySlots, device->numSlots);
+  if (slotIndex >= device->numSlots)
+    return -1;
+
+  __set_bit(slotIndex, device->busySlots);
+  client->slotByPointer[pointerIndex] = slotIndex;
+  device->slots[slotIndex].pointerIndex = pointerIndex;
+  device->slots[slotIndex].owner = client;
+  return slotIndex;
+}
+
+static void toccami_slot_release(struct toccami_device *device,
+                                 int slotIndex) {
+  struct toccami_slot *slot = &device->slots[slotIndex];
+
+  trace_toccami_slot_release(device->id, slotIndex, slot->pointerIndex,
+                             slot->x, slot->y);
+  slot->active = false;
+  slot->owner->slotByPointer[slot->pointerIndex] = NO_SLOT;
+}
+
+/** @brief Release a contact in the current frame, or when the resampled
+ * frames reach the current time
+ */
+static void toccami_report_release(struct toccami_device *device,
+                                   int slotIndex) {
+  if (device->outputPeriodNs) {
+    device->slots[slotIndex].releaseNs =
+        device->frameTimestamp ?: ktime_get_ns();
+  } else {
+    input_mt_slot(device->input, slotIndex);
+    input_mt_report_slot_state(device->input, MT_TOOL_FINGER, 0);
+    device->slots[slotIndex].sampleCount = 0;
+    device->slots[slotIndex].predicted = false;
+  }
+  toccami_slot_release(device, slotIndex);
+}
+
+// Add a sample to the history of a contact
+static void toccami_sample_push(struct toccami_slot *slot, u64 ns, u16 x,
+                                u16 y) {
+  struct toccami_sample *last;
+
+  if (slot->sampleCount) {
+    last = &slot->samples[(slot->sampleCount - 1) % RESAMPLE_HISTORY];
+    // Keep the history ordered, a late sample replaces the last position
+    if (ns <= last->ns) {
+      last->x = x;
+      last->y = y;
+      return;
+    }
+  }
+
+  slot->samples[slot->sampleCount++ % RESAMPLE_HISTORY] =
+      (struct toccami_sample){.ns = ns, .x = x, .y = y};
+}
+
+/** @brief Record the position of a contact for the resampled frames, at the
+ * capture time of the frame or now. Starts the output clock if needed
+ */
+static void toccami_resample_push(struct toccami_device *device,
+                                  struct toccami_slot *slot, u16 x, u16 y) {
+  u64 now = ktime_get_ns();
+
+  if (!device->resampling) {
+    WRITE_ONCE(device->resampling, true);
+    // Ticks are aligned on multiples of the period
+    hrtimer_start(&device->resampleTimer,
+                  ns_to_ktime((div64_u64(now, device->outputPeriodNs) + 1) *
+                              device->outputPeriodNs),
+                  HRTIMER_MODE_ABS);
+  }
+
+  toccami_sample_push(slot, device->frameTimestamp ?: now, x, y);
+}
+
+static u16 toccami_resample_lerp(u16 from, u16 to, s64 num, s64 den,
+                                 int max) {
+  return clamp_t(s64, from + div64_s64((s64)(to - from) * num, den), 0, max);
+}
+
+/** @brief Position of a contact predictNs after its last sample, moving at
+ * the average velocity of its samples of the last PREDICT_WINDOW_NS
+ *  @return false if there is no velocity to extrapolate from
+ */
+static bool toccami_predict_position(struct toccami_device *device,
+                                     const struct toccami_slot *slot, u16 *x,
+                                     u16 *y) {
+  const struct toccami_sample *sample, *newest, *oldest;
+  unsigned int i, count = min_t(unsigned int, slot->sampleCount,
+                                RESAMPLE_HISTORY);
+  int xMax = input_abs_get_max(device->input, ABS_MT_POSITION_X);
+  int yMax = input_abs_get_max(device->input, ABS_MT_POSITION_Y);
+  u64 span;
+
+  if (!count)
+    return false;
+
+  newest = &slot->samples[(slot->sampleCount - 1) % RESAMPLE_HISTORY];
+  oldest = newest;
+  for (i = 2; i <= count; i++) {
+    sample = &slot->samples[(slot->sampleCount - i) % RESAMPLE_HISTORY];
+    if (newest->ns - sample->ns > PREDICT_WINDOW_NS)
+      break;
+    oldest = sample;
+  }
+
+  span = newest->ns - oldest->ns;
+  if (!span)
+    return false;
+
+  *x = toccami_resample_lerp(oldest->x, newest->x, span + device->predictNs,
+                             span, xMax);
+  *y = toccami_resample_lerp(oldest->y, newest->y, span + device->predictNs,
+                             span, yMax);
+  return true;
+}
+
+/** @brief Position of a contact at renderNs, interpolated between the samples
+ * around it or extrapolated from the last two
+ *  @return false if no sample is old enough yet
+ */
+static bool toccami_resample_position(struct toccami_device *device,
+                                      const struct toccami_slot *slot,
+                                      u64 renderNs, u16 *x, u16 *y) {
+  const struct toccami_sample *sample, *before = NULL, *after = NULL;
+  const struct toccami_sample *previous = NULL;
+  unsigned int i, count = min_t(unsigned int, slot->sampleCount,
+                                RESAMPLE_HISTORY);
+  int xMax = input_abs_get_max(device->input, ABS_MT_POSITION_X);
+  int yMax = input_abs_get_max(device->input, ABS_MT_POSITION_Y);
+
+  // From the newest sample to the oldest
+  for (i = 1; i <= count; i++) {
+    sample = &slot->samples[(slot->sampleCount - i) % RESAMPLE_HISTORY];
+    if (sample->ns > renderNs) {
+      after = sample;
+    } else if (!before) {
+      before = sample;
+    } else {
+      previous = sample;
+      break;
+    }
+  }
+
+  if (!before)
+    return false;
+
+  if (after) {
+    *x = toccami_resample_lerp(before->x, after->x, renderNs - before->ns,
+                               after->ns - before->ns, xMax);
+    *y = toccami_resample_lerp(before->y, after->y, renderNs - before->ns,
+                               after->ns - before->ns, yMax);
+  } else if (previous &&
+             renderNs - before->ns <= RESAMPLE_MAX_EXTRAPOLATION_NS) {
+    *x = toccami_resample_lerp(previous->x, before->x,
+                               renderNs - previous->ns,
+                               before->ns - previous->ns, xMax);
+    *y = toccami_resample_lerp(previous->y, before->y,
+                               renderNs - previous->ns,
+                               before->ns - previous->ns, yMax);
+  } else {
+    *x = before->x;
+    *y = before->y;
+  }
+  return true;
+}
+
+/** @brief Report a frame of the output clock: the contacts as they were
+ * resampleDelayNs ago. Stops the clock when no contact is left
+ */
+static void toccami_resample_render(struct toccami_device *device) {
+  struct input_dev *toccamiInput = device->input;
+  // Prediction only moves the output clock closer to the samples
+  u64 renderNs = ktime_get_ns() - device->resampleDelayNs + device->predictNs;
+  struct toccami_slot *slot;
+  bool reported = false;
+  u16 x, y;
+  int i;
+
+  for_each_set_bit(i, device->busySlots, device->numSlots) {
+    slot = &device->slots[i];
+
+    if (slot->releaseNs && slot->releaseNs <= renderNs) {
+      if (slot->rendered) {
+        input_mt_slot(toccamiInput, i);
+        input_mt_report_slot_state(toccamiInput, MT_TOOL_FINGER, 0);
+        reported = true;
+      }
+      slot->rendered = false;
+      slot->sampleCount = 0;
+      slot->releaseNs = 0;
+      // Released and rendered, the slot can be used again
+      __clear_bit(i, device->busySlots);
+      continue;
+    }
+
+    if (!toccami_resample_position(device, slot, renderNs, &x, &y))
+      continue;
+
+    input_mt_slot(toccamiInput, i);
+    input_mt_report_slot_state(toccamiInput, MT_TOOL_FINGER, 1);
+    input_report_abs(toccamiInput, ABS_MT_POSITION_X, x);
+    input_report_abs(toccamiInput, ABS_MT_POSITION_Y, y);
+    slot->rendered = true;
+    reported = true;
+  }
+
+  if (reported) {
+    input_mt_sync_frame(toccamiInput);
+    input_sync(toccamiInput);
+  }
+
+  if (bitmap_empty(device->busySlots, device->numSlots))
+    WRITE_ONCE(device->resampling, false);
+}
+
+static void toccami_gestures_click(struct input_dev *gesturesInput,
+                                   unsigned int code) {
+  input_report_key(gesturesInput, code, 1);
+  input_sync(gesturesInput);
+  input_report_key(gesturesInput, code, 0);
+  input_sync(gesturesInput);
+}
+
+/** @brief Advance the gesture of a device with a synced frame, contacts is
+ * the number of slots still active. Taps are reported when the last contact
+ * goes up, scroll and pinch steps as soon as they are complete
+ */
+static void toccami_gestures_frame(struct toccami_device *device,
+                                   unsigned int contacts) {
+  struct toccami_gesture *gesture = &device->gesture;
+  struct input_dev *gesturesInput = device->gestures;
+  struct toccami_slot *slot, *first = NULL, *second = NULL;
+  u64 now = ktime_get_ns();
+  int unit, centroidX, centroidY, spread, stepsX, stepsY, i;
+
+  // Coordinate units per mm
+  unit = max(input_abs_get_res(device->input, ABS_MT_POSITION_X), 1);
+
+  if (!contacts) {
+    if (gesture->maxContacts && !gesture->moved &&
+        gesture->mode == GESTURE_NONE &&
+        now - gesture->startNs < GESTURE_TAP_MS * NSEC_PER_MSEC)
+      toccami_gestures_click(gesturesInput,
+                             gesture->maxContacts == 1   ? BTN_LEFT
+                             : gesture->maxContacts == 2 ? BTN_RIGHT
+                                                         : BTN_MIDDLE);
+    gesture->maxContacts = 0;
+    gesture->twoContacts = false;
+    return;
+  }
+
+  if (!gesture->maxContacts) {
+    gesture->startNs = now;
+    gesture->moved = false;
+    gesture->mode = GESTURE_NONE;
+  }
+  gesture->maxContacts = max(gesture->maxContacts, contacts);
+
+  for_each_set_bit(i, device->busySlots, device->numSlots) {
+    slot = &device->slots[i];
+    // Releases waiting for the output clock
+    if (!slot->active)
+      continue;
+    if (!first)
+      first = slot;
+    else
+      second = slot;
+    if (abs(slot->x - slot->startX) > GESTURE_TAP_MM * unit ||
+        abs(slot->y - slot->startY) > GESTURE_TAP_MM * unit)
+      gesture->moved = true;
+  }
+
+  if (contacts != 2) {
+    gesture->twoContacts = false;
+    return;
+  }
+
+  centroidX = (first->x + second->x) / 2;
+  centroidY = (first->y + second->y) / 2;
+  spread = abs(first->x - second->x) + abs(first->y - second->y);
+
+  if (!gesture->twoContacts) {
+    gesture->scrollX = 0;
+    gesture->scrollY = 0;
+    gesture->pinch = 0;
+  } else {
+    gesture->scrollX += centroidX - gesture->centroidX;
+    gesture->scrollY += centroidY - gesture->centroidY;
+    gesture->pinch += spread - gesture->spread;
+  }
+  gesture->twoContacts = true;
+  gesture->centroidX = centroidX;
+  gesture->centroidY = centroidY;
+  gesture->spread = spread;
+
+  if (gesture->mode == GESTURE_NONE) {
+    if (abs(gesture->pinch) >= GESTURE_PINCH_MM * unit)
+      gesture->mode = GESTURE_PINCH;
+    else if (abs(gesture->scrollX) >= GESTURE_SCROLL_MM * unit ||
+             abs(gesture->scrollY) >= GESTURE_SCROLL_MM * unit)
+      gesture->mode = GESTURE_SCROLL;
+  }
+
+  if (gesture->mode == GESTURE_SCROLL) {
+    stepsX = gesture->scrollX / (GESTURE_SCROLL_MM * unit);
+    stepsY = gesture->scrollY / (GESTURE_SCROLL_MM * unit);
+    if (stepsX || stepsY) {
+      // Contacts moving down scroll down, as a wheel turned towards the user
+      if (stepsY)
+        input_report_rel(gesturesInput, REL_WHEEL, -stepsY);
+      if (stepsX)
+        input_report_rel(gesturesInput, REL_HWHEEL, stepsX);
+      input_sync(gesturesInput);
+      gesture->scrollX -= stepsX * GESTURE_SCROLL_MM * unit;
+      gesture->scrollY -= stepsY * GESTURE_SCROLL_MM * unit;
+    }
+  } else if (gesture->mode == GESTURE_PINCH) {
+    for (; gesture->pinch >= GESTURE_PINCH_MM * unit;
+         gesture->pinch -= GESTURE_PINCH_MM * unit)
+      toccami_gestures_click(gesturesInput, KEY_ZOOMIN);
+    for (; gesture->pinch <= -GESTURE_PINCH_MM * unit;
+         gesture->pinch += GESTURE_PINCH_MM * unit)
+      toccami_gestures_click(gesturesInput, KEY_ZOOMOUT);
+  }
+}
+
+/** @brief Close the current frame of the device.
+ * Contacts of owner that the frame does not mention are released, like
+ * INPUT_MT_DROP_UNUSED would do, but skipped contacts count as mentioned.
+ * The contacts of other clients sharing the touchpad are left alone
+ *  @param owner The client the frame came from, NULL for every contact
+ */
+static void toccami_sync_frame(struct toccami_device *device,
+                               struct toccami_client *owner) {
+  struct input_dev *toccamiInput = device->input;
+  struct toccami_slot *slot;
+  unsigned int activeSlots = 0, timeout;
+  u64 activeMask = 0;
+  int i;
+
+  for_each_set_bit(i, device->busySlots, device->numSlots) {
+    slot = &device->slots[i];
+    if (slot->active && !slot->seen && (!owner || slot->owner == owner))
+      toccami_report_release(device, i);
+    slot->seen = false;
+    // Released slots can be used again by the next frame, once rendered if
+    // resampling
+    if (slot->active) {
+      activeSlots++;
+      activeMask |= BIT_ULL(i);
+    } else if (!slot->releaseNs) {
+      __clear_bit(i, device->busySlots);
+    }
+  }
+
+  // Resampled frames are reported by the output clock
+  if (!device->outputPeriodNs) {
+    input_mt_sync_frame(toccamiInput);
+    input_sync(toccamiInput);
+  }
+  trace_toccami_frame_sync(device->id, activeSlots, device->frameTimestamp);
+  if (owner)
+    owner->lastSyncNs = ktime_get_ns();
+
+  // Re-arming on every frame would let one busy client hide a stale one,
+  // the work arms it for the oldest client instead
+  timeout = READ_ONCE(watchdog_ms);
+  if (activeSlots && timeout) {
+    if (!hrtimer_is_queued(&device->watchdog))
+      hrtimer_start(&device->watchdog, ms_to_ktime(timeout),
+                    HRTIMER_MODE_REL);
+  } else {
+    hrtimer_try_to_cancel(&device->watchdog);
+  }
+
+  if (device->gestures)
+    toccami_gestures_frame(device, activeSlots);
+
+  if (activeMask != device->activeMask) {
+    WRITE_ONCE(device->activeMask, activeMask);
+    toccami_device_status_changed(device);
+  }
+
+  this_cpu_inc(device->stats->frames);
+  if (device->frameTimestamp) {
+    this_cpu_inc(device->stats->syncLatency[toccami_latency_bucket(
+        ktime_to_ns(ktime_get()) - device->frameTimestamp)]);
+    device->frameTimestamp = 0;
+  }
+}
+
+// The stylus leaves proximity, with device->lock held
+static void toccami_pen_out(struct toccami_device *device) {
+  struct input_dev *penInput = device->pen;
+  struct toccami_pen *penState = &device->penState;
+
+  if (!penState->inRange)
+    return;
+
+  input_report_key(penInput, BTN_TOUCH, 0);
+  input_report_key(penInput, BTN_STYLUS, 0);
+  input_report_key(penInput, BTN_STYLUS2, 0);
+  input_report_abs(penInput, ABS_PRESSURE, 0);
+  input_report_key(penInput, penState->tool, 0);
+  input_sync(penInput);
+
+  penState->inRange = false;
+  penState->owner = NULL;
+}
+
+/** @brief Release the contacts reported by a client, or all of them if owner
+ * is NULL, in a frame of their own, and take its stylus out of proximity.
+ * Called with device->lock held
+ *  @return true if a contact was down
+ */
+static bool toccami_device_release(struct toccami_device *device,
+                                   struct toccami_client *owner) {
+  struct toccami_slot *slot;
+  bool released = false;
+  int i;
+
+  for_each_set_bit(i, device->busySlots, device->numSlots) {
+    slot = &device->slots[i];
+    // The contacts of other clients stay down through this sync
+    slot->seen = owner && slot->owner != owner;
+    released |= slot->active && !slot->seen;
+  }
+
+  if (released || device->framePending) {
+    toccami_sync_frame(device, NULL);
+    device->framePending = false;
+  }
+
+  if (device->pen && (!owner || device->penState.owner == owner))
+    toccami_pen_out(device);
+  return released;
+}
+
+/** @brief Change the axes of a device between two frames, with device->lock
+ * held. Positions on the old axes cannot be rescaled by clients, so the
+ * contacts still down are released and the current frame is synced first
+ */
+static void toccami_device_set_axes(struct toccami_device *device, u16 xMax,
+                                    u16 yMax, u16 xRes, u16 yRes) {
+  struct input_dev *toccamiInput = device->input;
+
+  toccami_device_release(device, NULL);
+
+  // Same locking as EVIOCSABS, readers of absinfo never see mixed axes
+  spin_lock_irq(&toccamiInput->event_lock);
+  input_abs_set_max(toccamiInput, ABS_X, xMax);
+  input_abs_set_max(toccamiInput, ABS_Y, yMax);
+  input_abs_set_max(toccamiInput, ABS_MT_POSITION_X, xMax);
+  input_abs_set_max(toccamiInput, ABS_MT_POSITION_Y, yMax);
+  input_abs_set_res(toccamiInput, ABS_X, xRes);
+  input_abs_set_res(toccamiInput, ABS_Y, yRes);
+  input_abs_set_res(toccamiInput, ABS_MT_POSITION_X, xRes);
+  input_abs_set_res(toccamiInput, ABS_MT_POSITION_Y, yRes);
+  spin_unlock_irq(&toccamiInput->event_lock);
+
+  if (device->pen) {
+    spin_lock_irq(&device->pen->event_lock);
+    input_abs_set_max(device->pen, ABS_X, xMax);
+    input_abs_set_max(device->pen, ABS_Y, yMax);
+    input_abs_set_res(device->pen, ABS_X, xRes);
+    input_abs_set_res(device->pen, ABS_Y, yRes);
+    spin_unlock_irq(&device->pen->event_lock);
+  }
+
+  toccami_device_status_changed(device);
+}
+
+/** @brief Map a position written by a producer to the axes of a device with
+ * its transform, in integer math only
+ */
+static void toccami_transform_position(struct toccami_device *device, u16 *x,
+                                       u16 *y) {
+  const struct toccami_transform *transform = &device->transform;
+  s64 sourceX = min(*x, transform->width);
+  s64 sourceY = min(*y, transform->height);
+  s64 rotatedX, rotatedY, width, height;
+
+  switch (transform->rotation) {
+  case TOCCAMI_ROTATE_90:
+    rotatedX = transform->height - sourceY;
+    rotatedY = sourceX;
+    break;
+  case TOCCAMI_ROTATE_180:
+    rotatedX = transform->width - sourceX;
+    rotatedY = transform->height - sourceY;
+    break;
+  case TOCCAMI_ROTATE_270:
+    rotatedX = sourceY;
+    rotatedY = transform->width - sourceX;
+    break;
+  default:
+    rotatedX = sourceX;
+    rotatedY = sourceY;
+  }
+
+  // Quarter turns swap the sides
+  width = transform->rotation & 1 ? transform->height : transform->width;
+  height = transform->rotation & 1 ? transform->width : transform->height;
+  if (transform->flags & TOCCAMI_FLIP_X)
+    rotatedX = width - rotatedX;
+  if (transform->flags & TOCCAMI_FLIP_Y)
+    rotatedY = height - rotatedY;
+
+  *x = clamp_t(s64, ((rotatedX * transform->xScale) >> 16) + transform->xOffset,
+               0, input_abs_get_max(device->input, ABS_MT_POSITION_X));
+  *y = clamp_t(s64, ((rotatedY * transform->yScale) >> 16) + transform->yOffset,
+               0, input_abs_get_max(device->input, ABS_MT_POSITION_Y));
+}
+
+/** @brief Bring a position written by a producer on the axes of a device:
+ * transformed if it has a transform, clamped otherwise, with device->lock
+ * held like the axes changes
+ */
+static void toccami_map_position(struct toccami_device *device, u16 *x,
+                                 u16 *y) {
+  if (device->transform.width && device->transform.height) {
+    toccami_transform_position(device, x, y);
+    return;
+  }
+
+  *x = min_t(u16, *x, input_abs_get_max(device->input, ABS_MT_POSITION_X));
+  *y = min_t(u16, *y, input_abs_get_max(device->input, ABS_MT_POSITION_Y));
+}
+
+/** @brief Report a stylus record on the pen device of a client. Samples are
+ * synced right away: the pen has no frames, and waiting for the multitouch
+ * separator would only delay it
+ */
+static void toccami_report_pen(struct toccami_client *client, u16 x, u16 y,
+                               u16 pointerIndex, u16 eventType) {
+  struct toccami_device *device = client->device;
+  struct input_dev *penInput = device->pen;
+  struct toccami_pen *penState = &device->penState;
+  unsigned int tool, pressure;
+
+  if (!penInput)
+    return;
+
+  if (eventType == TOCCAMI_EVENT_PEN_TILT) {
+    penState->tiltX = clamp_t(int, (s16)x, -90, 90);
+    penState->tiltY = clamp_t(int, (s16)y, -90, 90);
+    penState->distance = min_t(unsigned int, pointerIndex, U8_MAX);
+    return;
+  }
+
+  if (eventType == TOCCAMI_EVENT_PEN_OUT) {
+    toccami_pen_out(device);
+    return;
+  }
+
+  tool = pointerIndex & TOCCAMI_PEN_ERASER ? BTN_TOOL_RUBBER : BTN_TOOL_PEN;
+  // Switching tool goes out of proximity first, as tablets do
+  if (penState->inRange && penState->tool != tool)
+    toccami_pen_out(device);
+
+  toccami_map_position(device, &x, &y);
+  pressure = pointerIndex & TOCCAMI_PEN_PRESSURE;
+
+  input_report_key(penInput, tool, 1);
+  input_report_key(penInput, BTN_TOUCH, pressure > 0);
+  input_report_key(penInput, BTN_STYLUS, pointerIndex & TOCCAMI_PEN_BUTTON);
+  input_report_key(penInput, BTN_STYLUS2, pointerIndex & TOCCAMI_PEN_BUTTON2);
+  input_report_abs(penInput, ABS_X, x);
+  input_report_abs(penInput, ABS_Y, y);
+  input_report_abs(penInput, ABS_PRESSURE, pressure);
+  input_report_abs(penInput, ABS_TILT_X, penState->tiltX);
+  input_report_abs(penInput, ABS_TILT_Y, penState->tiltY);
+  input_report_abs(penInput, ABS_DISTANCE, pressure ? 0 : penState->distance);
+  input_sync(penInput);
+
+  penState->inRange = true;
+  penState->tool = tool;
+  penState->owner = client;
+}
+
+/** @brief Throw away records while the device is idle, only the axes
+ * changes and stylus records, which go to another input device, are kept
+ */
+static void toccami_skip_records(struct toccami_client *client,
+                                 const struct toccami_record *records,
+                                 unsigned int count) {
+  struct toccami_device *device = client->device;
+  unsigned int i;
+  u16 x, y, pointerIndex, eventType;
+
+  for (i = 0; i < count; i++) {
+    eventType = READ_ONCE(records[i].eventType);
+    if (eventType != TOCCAMI_EVENT_CHANGE_RESOLUTION &&
+        (eventType < TOCCAMI_EVENT_PEN || eventType > TOCCAMI_EVENT_PEN_OUT))
+      continue;
+    x = READ_ONCE(records[i].x);
+    y = READ_ONCE(records[i].y);
+    pointerIndex = READ_ONCE(records[i].pointerIndex);
+    if (eventType != TOCCAMI_EVENT_CHANGE_RESOLUTION)
+      toccami_report_pen(client, x, y, pointerIndex, eventType);
+    else if (x && y)
+      toccami_device_set_axes(device, x, y, pointerIndex, pointerIndex);
+  }
+}
+
+/** @brief Handle a record that is not a contact going down or up: frame
+ * separators once per frame, the rest rarely if ever. Unknown types are
+ * ignored
+ */
+static void toccami_report_control(struct toccami_client *client, u16 x, u16 y,
+                                   u16 pointerIndex, u16 eventType) {
+  struct toccami_device *device = client->device;
+  struct input_dev *toccamiInput = device->input;
+  int slotIndex;
+
+  switch (eventType) {
+  case TOCCAMI_EVENT_SYNC:
+    if (device->framePending)
+      toccami_sync_frame(device, client);
+    device->framePending = false;
+    break;
+
+  case TOCCAMI_EVENT_TIMESTAMP:
+    device->framePending = true;
+    toccami_set_frame_timestamp(client,
+                                (u64)pointerIndex << 32 | (u32)y << 16 | x);
+    break;
+
+  case TOCCAMI_EVENT_CHANGE_RESOLUTION:
+    device->framePending = true;
+    trace_toccami_resolution(device->id, x, y, pointerIndex);
+    // The driver relies on pointerIndex to communicate the resolution
+    if (x && y)
+      toccami_device_set_axes(device, x, y, pointerIndex, pointerIndex);
+    break;
+
+  case TOCCAMI_EVENT_CONTACT_ATTR:
+    device->framePending = true;
+    slotIndex = toccami_slot_lookup(device, client, pointerIndex, false);
+    if (device->contactAttrs && slotIndex >= 0 &&
+        device->slots[slotIndex].active) {
+      input_mt_slot(toccamiInput, slotIndex);
+      input_report_abs(toccamiInput, ABS_MT_PRESSURE, x & 0xff);
+      input_report_abs(toccamiInput, ABS_MT_ORIENTATION,
+                       max_t(int, (s8)(x >> 8), -S8_MAX));
+      input_report_abs(toccamiInput, ABS_MT_TOUCH_MAJOR, y & 0xff);
+      input_report_abs(toccamiInput, ABS_MT_TOUCH_MINOR, y >> 8);
+    }
+    break;
+
+  case TOCCAMI_EVENT_PEN:
+  case TOCCAMI_EVENT_PEN_TILT:
+  case TOCCAMI_EVENT_PEN_OUT:
+    toccami_report_pen(client, x, y, pointerIndex, eventType);
+    break;
+  }
+}
+
+/** @brief Report count records of a client to its input device, called by
+ * the device worker.
+ * Every TOCCAMI_EVENT_SYNC record closes the frame if records were reported
+ * since the previous one.
+ * Each field is read only once, so records may live in memory shared with
+ * userspace.
+ *  @param client The client the records come from
+ *  @param records Pointer to the first record
+ *  @param count Number of records to report
+ */
+static void toccami_report_records(struct toccami_client *client,
+                                   const struct toccami_record *records,
+                                   unsigned int count) {
+  struct toccami_device *device = client->device;
+  struct input_dev *toccamiInput = device->input;
+  struct toccami_slot *slot;
+  unsigned int i;
+  int slotIndex;
+  u16 x, y, pointerIndex, eventType, reportX, reportY;
+
+  this_cpu_add(device->stats->records, count);
+
+  if (device->idle) {
+    toccami_skip_records(client, records, count);
+    return;
+  }
+
+  for (i = 0; i < count; i++) {
+    // Now parse parameters of touch event
+    x = READ_ONCE(records[i].x);
+    y = READ_ONCE(records[i].y);
+    pointerIndex = READ_ONCE(records[i].pointerIndex);
+    eventType = READ_ONCE(records[i].eventType);
+    trace_toccami_record(device->id, pointerIndex, x, y, eventType);
+
+    if (unlikely(eventType > TOCCAMI_EVENT_DOWN)) {
+      toccami_report_control(client, x, y, pointerIndex, eventType);
+      continue;
+    }
+
+    device->framePending = true;
+
+    slotIndex = toccami_slot_lookup(device, client, pointerIndex,
+                                    eventType == TOCCAMI_EVENT_DOWN);
+    if (slotIndex < 0)
+      continue;
+    slot = &device->slots[slotIndex];
+    slot->seen = true;
+
+    if (eventType == TOCCAMI_EVENT_DOWN) {
+
+      toccami_map_position(device, &x, &y);
+
+      // A contact left at a predicted position needs its next sample
+      if (coalesce_motion && slot->active && !slot->predicted &&
+          abs(x - slot->x) <= motion_threshold &&
+          abs(y - slot->y) <= motion_threshold) {
+        this_cpu_inc(device->stats->coalesced);
+        continue;
+      }
+
+      if (device->outputPeriodNs) {
+        toccami_resample_push(device, slot, x, y);
+      } else {
+        reportX = x;
+        reportY = y;
+        // The prediction always starts from the real samples, it is
+        // corrected by every new one
+        if (device->predictNs) {
+          toccami_sample_push(slot, device->frameTimestamp ?: ktime_get_ns(),
+                              x, y);
+          toccami_predict_position(device, slot, &reportX, &reportY);
+          slot->predicted = reportX != x || reportY != y;
+        }
+
+        input_mt_slot(toccamiInput, slotIndex);
+        input_mt_report_slot_state(toccamiInput, MT_TOOL_FINGER, 1);
+
+        input_report_abs(toccamiInput, ABS_MT_POSITION_X, reportX);
+        input_report_abs(toccamiInput, ABS_MT_POSITION_Y, reportY);
+      }
+
+      if (!slot->active) {
+        trace_toccami_slot_assign(
+            device->id, slotIndex, pointerIndex,
+            input_mt_get_value(&toccamiInput->mt->slots[slotIndex],
+                               ABS_MT_TRACKING_ID),
+            x, y);
+        slot->startX = x;
+        slot->startY = y;
+      }
+      slot->active = true;
+      slot->x = x;
+      slot->y = y;
+
+    } else {
+      toccami_report_release(device, slotIndex);
+    }
+  }
+}
+
+/** @brief Report records of the shared ring of a client. Little-endian hosts
+ * report them in place, the others convert them to the drain buffer first
+ */
+static void toccami_report_events(struct toccami_client *client,
+                                  const struct toccami_event *events,
+                                  unsigned int count) {
+  struct toccami_device *device = client->device;
+  unsigned int i, batch;
+
+  if (!IS_ENABLED(CONFIG_CPU_BIG_ENDIAN)) {
+    toccami_report_records(client, (const struct toccami_record *)events,
+                           count);
+    return;
+  }
+
+  while (count) {
+    batch = min_t(unsigned int, count, DRAIN_BATCH);
+    for (i = 0; i < batch; i++)
+      device->drain[i] = toccami_record_from_event(&events[i]);
+    toccami_report_records(client, device->drain, batch);
+    events += batch;
+    count -= batch;
+  }
+}
+
+// Report everything the client made visible to the worker
+static void toccami_client_drain(struct toccami_client *client) {
+  struct toccami_device *device = client->device;
+  unsigned int count, left;
+  u32 head, size, first;
+
+  // Only what is already there, a busy producer can't starve the others
+  spin_lock(&client->queueLock);
+  left = kfifo_len(&client->queue);
+  while (left) {
+    count = kfifo_out(&client->queue, device->drain,
+                      min_t(unsigned int, left, DRAIN_BATCH));
+    if (!count)
+      break;
+    toccami_report_records(client, device->drain, count);
+    left -= count;
+  }
+  spin_unlock(&client->queueLock);
+  wake_up_interruptible(&client->queueWait);
+
+  head = smp_load_acquire(&client->ringHead);
+  if (head != client->ringTail) {
+    size = client->ringSize;
+    first = min(head - client->ringTail,
+                size - (client->ringTail & (size - 1)));
+    toccami_report_events(
+        client, client->ringRecords + (client->ringTail & (size - 1)), first);
+    toccami_report_events(client, client->ringRecords,
+                          head - client->ringTail - first);
+
+    smp_store_release(&client->ringTail, head);
+    smp_store_release(&client->ring->tail, head);
+  }
+
+  // A doorbell may publish a frame without its separator
+  if (device->framePending) {
+    toccami_sync_frame(device, client);
+    device->framePending = false;
+  }
+}
+
+/** @brief Follow the input device being opened and closed, and the device
+ * being drained. Contacts left down when it goes idle are released, so
+ * whoever opens it next starts from a clean state
+ */
+static void toccami_device_update_idle(struct toccami_device *device) {
+  bool idle = !toccami_device_open(device) || READ_ONCE(device->quiesce);
+
+  if (idle == device->idle)
+    return;
+  if (idle)
+    toccami_device_release(device, NULL);
+  device->idle = idle;
+}
+
+/** @brief Release the contacts of the clients that sent no frame for
+ * watchdog_ms, and arm the watchdog for the next client that could.
+ * Called with device->lock held
+ */
+static void toccami_device_check_watchdog(struct toccami_device *device) {
+  unsigned int timeout = READ_ONCE(watchdog_ms);
+  u64 now = ktime_get_ns(), deadline = 0;
+  struct toccami_client *owner;
+  int i;
+
+  if (!timeout)
+    return;
+
+  for_each_set_bit(i, device->busySlots, device->numSlots) {
+    if (!device->slots[i].active)
+      continue;
+    owner = device->slots[i].owner;
+    if (now - owner->lastSyncNs >= (u64)timeout * NSEC_PER_MSEC) {
+      if (toccami_device_release(device, owner))
+        this_cpu_inc(device->stats->watchdog);
+    } else if (!deadline ||
+               owner->lastSyncNs + (u64)timeout * NSEC_PER_MSEC < deadline) {
+      deadline = owner->lastSyncNs + (u64)timeout * NSEC_PER_MSEC;
+    }
+  }
+
+  if (deadline)
+    hrtimer_start(&device->watchdog, ns_to_ktime(deadline), HRTIMER_MODE_ABS);
+}
+
+static void toccami_device_work(struct work_struct *work) {
+  struct toccami_device *device =
+      container_of(work, struct toccami_device, work);
+  struct toccami_client *client;
+
+  mutex_lock(&device->lock);
+  toccami_device_update_idle(device);
+  list_for_each_entry(client, &device->clients, node)
+    toccami_client_drain(client);
+
+  // The watchdog may have fired before the frames drained above
+  toccami_device_check_watchdog(device);
+
+  if (atomic_xchg(&device->resampleTick, 0))
+    toccami_resample_render(device);
+  mutex_unlock(&device->lock);
+}
+
+/** @brief Drain a device for a reason, or resume it once no reason is left.
+ * What is queued is reported first, then new writes are refused and the
+ * contacts are released. Returns once the worker has done so, writes that
+ * raced with the drain are skipped by the worker
+ */
+static void toccami_device_quiesce(struct toccami_device *device,
+                                   unsigned int reason, bool quiesce) {
+  if (quiesce) {
+    queue_work(toccamiWq, &device->work);
+    flush_work(&device->work);
+    set_bit(reason, &device->quiesce);
+  } else {
+    clear_bit(reason, &device->quiesce);
+  }
+
+  queue_work(toccamiWq, &device->work);
+  flush_work(&device->work);
+  toccami_device_status_changed(device);
+}
+
+// Contacts would stay down through a sleep, release them before it
+static int toccami_pm_notify(struct notifier_block *nb, unsigned long action,
+                             void *data) {
+  struct toccami_device *device;
+  bool suspend;
+
+  switch (action) {
+  case PM_HIBERNATION_PREPARE:
+  case PM_SUSPEND_PREPARE:
+    suspend = true;
+    break;
+  case PM_POST_HIBERNATION:
+  case PM_POST_SUSPEND:
+    suspend = false;
+    break;
+  default:
+    return NOTIFY_DONE;
+  }
+
+  mutex_lock(&toccamiDevicesLock);
+  list_for_each_entry(device, &toccamiDevices, node)
+    toccami_device_quiesce(device, QUIESCE_SUSPEND, suspend);
+  mutex_unlock(&toccamiDevicesLock);
+
+  return NOTIFY_OK;
+}
+
+static enum hrtimer_restart toccami_device_watchdog(struct hrtimer *timer) {
+  struct toccami_device *device =
+      container_of(timer, struct toccami_device, watchdog);
+
+  // The input core is fed from the worker only
+  queue_work(toccamiWq, &device->work);
+  return HRTIMER_NORESTART;
+}
+
+static enum hrtimer_restart
+toccami_device_resample_tick(struct hrtimer *timer) {
+  struct toccami_device *device =
+      container_of(timer, struct toccami_device, resampleTimer);
+
+  atomic_set(&device->resampleTick, 1);
+  queue_work(toccamiWq, &device->work);
+
+  // A contact pushed after the clock stopped restarts it
+  if (!READ_ONCE(device->resampling))
+    return HRTIMER_NORESTART;
+  hrtimer_forward_now(timer, ns_to_ktime(device->outputPeriodNs));
+  return HRTIMER_RESTART;
+}
+
+/** @brief Tell whether a frame only moves contacts that are already down,
+ * i.e. it puts down the same pointers as the previous frame of the client
+ * and releases nothing. Keeps track of the pointers down after the frame.
+ *  @param records Records of the frame, without its separator
+ *  @param count Number of records
+ */
+static bool toccami_frame_is_motion(struct toccami_client *client,
+                                    const struct toccami_record *records,
+                                    unsigned int count) {
+  u16 pointers[MAX_TOUCHES_LIMIT];
+  unsigned int i, j, pointerCount = 0;
+  bool motion = true;
+
+  // Empty frames are never reported
+  if (count == 0)
+    return true;
+
+  for (i = 0; i < count; i++) {
+    if (records[i].eventType == TOCCAMI_EVENT_TIMESTAMP ||
+        records[i].eventType == TOCCAMI_EVENT_CONTACT_ATTR)
+      continue;
+
+    if (records[i].eventType != TOCCAMI_EVENT_DOWN ||
+        pointerCount == MAX_TOUCHES_LIMIT) {
+      motion = false;
+      continue;
+    }
+
+    pointers[pointerCount++] = records[i].pointerIndex;
+  }
+
+  if (motion) {
+    motion = pointerCount == client->framePointerCount;
+    for (i = 0; motion && i < pointerCount; i++) {
+      for (j = 0; j < pointerCount; j++)
+        if (client->framePointers[j] == pointers[i])
+          break;
+      motion = j < pointerCount;
+    }
+  }
+
+  if (pointerCount == MAX_TOUCHES_LIMIT && !motion) {
+    // Too many records to know which pointers are left down
+    client->framePointerCount = MAX_TOUCHES_LIMIT + 1;
+  } else {
+    memcpy(client->framePointers, pointers, pointerCount * sizeof(u16));
+    client->framePointerCount = pointerCount;
+  }
+
+  return motion;
+}
+
+// Mark the separators closing motion-only frames
+static void toccami_tag_frames(struct toccami_client *client,
+                               struct toccami_record *records,
+                               unsigned int count) {
+  unsigned int i, start = 0;
+
+  for (i = 0; i < count; i++) {
+    if (records[i].eventType != TOCCAMI_EVENT_SYNC)
+      continue;
+
+    records[i].pointerIndex =
+        toccami_frame_is_motion(client, records + start, i - start)
+            ? SYNC_MOTION_FRAME
+            : 0;
+    start = i + 1;
+  }
+}
+
+static int toccami_client_compact_alloc(struct toccami_client *client) {
+  if (!client->compactBuffer)
+    client->compactBuffer =
+        kmalloc_array(kfifo_size(&client->queue),
+                      sizeof(struct toccami_record), GFP_KERNEL);
+  return client->compactBuffer ? 0 : -ENOMEM;
+}
+
+/** @brief Merge a record in the motion-only frame at the end of records,
+ * replacing the record of the same kind for the same pointer or adding it
+ * before the separator.
+ *  @param start Index of the first record of the frame
+ *  @param end Index following the frame separator, updated
+ */
+static void toccami_merge_record(struct toccami_record *records,
+                                 unsigned int start, unsigned int *end,
+                                 struct toccami_record record) {
+  unsigned int i;
+
+  for (i = start; i < *end - 1; i++) {
+    if (records[i].eventType == record.eventType &&
+        (record.eventType == TOCCAMI_EVENT_TIMESTAMP ||
+         records[i].pointerIndex == record.pointerIndex)) {
+      records[i] = record;
+      return;
+    }
+  }
+
+  records[*end] = records[*end - 1];
+  records[*end - 1] = record;
+  (*end)++;
+}
+
+/** @brief Free room in a full client queue by merging every run of
+ * consecutive motion-only frames in a single frame holding the latest value
+ * of each record, frames with contact transitions are left untouched.
+ * Motion-only frames put down the same pointers as the frame before them, so
+ * the merged frame still does.
+ *  @return The number of records dropped
+ */
+static unsigned int toccami_client_compact(struct toccami_client *client) {
+  struct toccami_record *records = client->compactBuffer;
+  unsigned int i, j, start, count, out = 0;
+  // Start of the last frame copied out when it is a motion-only one
+  int motionStart = -1;
+  bool motion;
+
+  spin_lock(&client->queueLock);
+
+  count = kfifo_out(&client->queue, records, kfifo_size(&client->queue));
+
+  // out never goes past the record being read
+  for (start = 0; start < count; start = i + 1) {
+    // Every queued write ends with a separator
+    for (i = start; records[i].eventType != TOCCAMI_EVENT_SYNC; i++)
+      ;
+    motion = records[i].pointerIndex == SYNC_MOTION_FRAME;
+
+    if (motion && motionStart >= 0) {
+      for (j = start; j < i; j++)
+        toccami_merge_record(records, motionStart, &out, records[j]);
+      continue;
+    }
+
+    motionStart = motion ? out : -1;
+    for (j = start; j <= i; j++)
+      records[out++] = records[j];
+  }
+
+  kfifo_in(&client->queue, records, out);
+
+  spin_unlock(&client->queueLock);
+
+  return count - out;
+}
+
+/** @brief Make records visible to the device worker, waiting for room in the
+ * client queue unless nonblock is set. Called with the client lock held.
+ * With drop_motion a full queue is compacted first.
+ *  @param records Records to queue, ending with a frame separator
+ *  @param count Number of records, at most queue_records
+ */
+static int toccami_client_enqueue(struct toccami_client *client,
+                                  struct toccami_record *records,
+                                  unsigned int count, bool nonblock) {
+  unsigned int dropped;
+
+  if (kfifo_avail(&client->queue) < count && drop_motion &&
+      toccami_client_compact_alloc(client) == 0) {
+    dropped = toccami_client_compact(client);
+    if (dropped) {
+      this_cpu_add(client->device->stats->dropped, dropped);
+      toccami_device_status_changed(client->device);
+    }
+  }
+
+  if (kfifo_avail(&client->queue) < count) {
+    if (nonblock)
+      return -EAGAIN;
+    if (wait_event_interruptible(client->queueWait,
+                                 kfifo_avail(&client->queue) >= count))
+      return -ERESTARTSYS;
+  }
+
+  if (drop_motion)
+    toccami_tag_frames(client, records, count);
+
+  toccami_capture(client->device, records, count);
+  kfifo_in(&client->queue, records, count);
+
+  queue_work(toccamiWq, &client->device->work);
+
+  return 0;
+}
+
+/** @brief Convert a records write in the staging buffer of a client to host
+ * order, in place, and close it with a separator
+ *  @return The number of records
+ */
+static unsigned int toccami_records_decode(struct toccami_client *client,
+                                           size_t len) {
+  struct toccami_record *records = client->staging;
+  unsigned int i, count = len / TOCCAMI_EVENT_LENGTH;
+
+  if (IS_ENABLED(CONFIG_CPU_BIG_ENDIAN))
+    for (i = 0; i < count; i++)
+      records[i] =
+          toccami_record_from_event((struct toccami_event *)&records[i]);
+
+  records[count++] =
+      (struct toccami_record){.eventType = TOCCAMI_EVENT_SYNC};
+  return count;
+}
+
+/** @brief Decode a compact write from the wire buffer of a client to its
+ * staging buffer, starting from the committed positions.
+ *  @return The number of records, or -EINVAL, -EMSGSIZE
+ */
+static int toccami_compact_decode(struct toccami_client *client, size_t len) {
+  struct toccami_compact_state *state = &client->compact[1];
+  struct toccami_record *records = client->staging;
+  const u8 *wire = client->wire, *end = wire + len;
+  DECLARE_BITMAP(mentioned, COMPACT_POINTERS);
+  unsigned int count = 0, contacts, i;
+  u8 flags, pointerIndex, kind;
+  int x, y;
+
+  memcpy(state, &client->compact[0], sizeof(*state));
+
+  while (wire < end) {
+    if (end - wire < 2)
+      return -EINVAL;
+    contacts = wire[0];
+    flags = wire[1];
+    wire += 2;
+    bitmap_zero(mentioned, COMPACT_POINTERS);
+
+    if (flags & ~TOCCAMI_FRAME_TIMESTAMP)
+      return -EINVAL;
+    // The contacts, the timestamp and the separator
+    if (count + contacts + !!(flags & TOCCAMI_FRAME_TIMESTAMP) + 1 >
+        max_write_records + 1)
+      return -EMSGSIZE;
+
+    if (flags & TOCCAMI_FRAME_TIMESTAMP) {
+      if (end - wire < 6)
+        return -EINVAL;
+      records[count++] = (struct toccami_record){
+          .x = get_unaligned_le16(wire),
+          .y = get_unaligned_le16(wire + 2),
+          .pointerIndex = get_unaligned_le16(wire + 4),
+          .eventType = TOCCAMI_EVENT_TIMESTAMP};
+      wire += 6;
+    }
+
+    for (; contacts; contacts--) {
+      if (end - wire < 2)
+        return -EINVAL;
+      pointerIndex = wire[0];
+      kind = wire[1];
+      wire += 2;
+
+      if (kind == TOCCAMI_CONTACT_RELEASED) {
+        __clear_bit(pointerIndex, state->down);
+        records[count++] = (struct toccami_record){
+            .pointerIndex = pointerIndex,
+            .eventType = TOCCAMI_EVENT_RELEASED};
+        continue;
+      }
+
+      if (kind == TOCCAMI_CONTACT_ABSOLUTE) {
+        if (end - wire < 4)
+          return -EINVAL;
+        x = get_unaligned_le16(wire);
+        y = get_unaligned_le16(wire + 2);
+        wire += 4;
+      } else if (kind == TOCCAMI_CONTACT_DELTA ||
+                 kind == TOCCAMI_CONTACT_STILL) {
+        if (!test_bit(pointerIndex, state->down))
+          return -EINVAL;
+        x = state->x[pointerIndex];
+        y = state->y[pointerIndex];
+        if (kind == TOCCAMI_CONTACT_DELTA) {
+          if (end - wire < 2)
+            return -EINVAL;
+          x = clamp_t(int, x + (s8)wire[0], 0, U16_MAX);
+          y = clamp_t(int, y + (s8)wire[1], 0, U16_MAX);
+          wire += 2;
+        }
+      } else {
+        return -EINVAL;
+      }
+
+      __set_bit(pointerIndex, state->down);
+      __set_bit(pointerIndex, mentioned);
+      state->x[pointerIndex] = x;
+      state->y[pointerIndex] = y;
+      records[count++] = (struct toccami_record){
+          .x = x,
+          .y = y,
+          .pointerIndex = pointerIndex,
+          .eventType = TOCCAMI_EVENT_DOWN};
+    }
+
+    // The pointers the frame left out are released explicitly, a frame
+    // without records would not be reported at all
+    for_each_set_bit(i, state->down, COMPACT_POINTERS) {
+      if (test_bit(i, mentioned))
+        continue;
+      if (count >= max_write_records)
+        return -EMSGSIZE;
+      __clear_bit(i, state->down);
+      records[count++] = (struct toccami_record){
+          .pointerIndex = i, .eventType = TOCCAMI_EVENT_RELEASED};
+    }
+
+    records[count++] = (struct toccami_record){
+        .eventType = TOCCAMI_EVENT_SYNC};
+  }
+
+  return count;
+}
 
+/** @brief Check the length of a payload in the format of a client
+ *  @return 0, or -EINVAL, -EMSGSIZE
+ */
+static int toccami_client_check_size(struct toccami_client *client,
+                                     size_t len) {
   // Only accept multiple of EVENT_LENGTH
-  if (len % TOCCAMI_EVENT_LENGTH != 0) {
-    printk(KERN_ERR "toccami: invalid message SIZE: %zu\n", len);
+  if (client->format == TOCCAMI_FORMAT_RECORDS &&
+      len % TOCCAMI_EVENT_LENGTH != 0) {
+    printk_ratelimited(KERN_ERR "toccami: invalid message SIZE: %zu\n", len);
+    this_cpu_inc(client->device->stats->invalidSize);
     return -EINVAL;
   }
 
-  touchCount = len / TOCCAMI_EVENT_LENGTH;
+  if (len > max_write_records * TOCCAMI_EVENT_LENGTH) {
+    printk_ratelimited(KERN_ERR "toccami: message too big: %zu\n", len);
+    this_cpu_inc(client->device->stats->invalidSize);
+    return -EMSGSIZE;
+  }
 
-  for (i = 0; i < touchCount; i++) {
-    // Copy the buffer from user
-    if (copy_from_user(kernelBuffer, buffer + i * TOCCAMI_EVENT_LENGTH,
-                       TOCCAMI_EVENT_LENGTH) != 0) {
-      return -EFAULT;
+  return 0;
+}
+
+// Where the payload of a write goes before toccami_client_submit
+static void *toccami_client_payload(struct toccami_client *client) {
+  if (client->format == TOCCAMI_FORMAT_COMPACT)
+    return client->wire;
+  return client->staging;
+}
+
+/** @brief Queue the len bytes payload copied to toccami_client_payload, with
+ * client->lock held
+ *  @return 0, or the errors of toccami_compact_decode and
+ * toccami_client_enqueue
+ */
+static int toccami_client_submit(struct toccami_client *client, size_t len,
+                                 bool nonblock) {
+  unsigned int touchCount;
+  int ret;
+
+  if (READ_ONCE(client->device->quiesce))
+    return -ESHUTDOWN;
+
+  if (client->format == TOCCAMI_FORMAT_COMPACT) {
+    ret = toccami_compact_decode(client, len);
+    if (ret < 0) {
+      this_cpu_inc(client->device->stats->invalidSize);
+      return ret;
     }
+    touchCount = ret;
+  } else {
+    touchCount = toccami_records_decode(client, len);
+  }
 
-    // Now parse parameters of touch event
-    x = *((u16 *)kernelBuffer);
-    y = *(u16 *)(kernelBuffer + 2);
-    pointerIndex = *(u16 *)(kernelBuffer + 4);
-    eventType = *(u16 *)(kernelBuffer + 6);
-
-    // If trying to change resolution, update accordingly
-    if (eventType == TOCCAMI_EVENT_CHANGE_RESOLUTION) {
-      printk(KERN_DEBUG
-             "toccami: Changing resolution: Width=%u; Height=%u; RES=%u\n",
-             x, y, pointerIndex);
-      input_abs_set_min(toccamiInput, ABS_X, 0);
-      input_abs_set_min(toccamiInput, ABS_Y, 0);
-      input_abs_set_max(toccamiInput, ABS_X, x);
-      input_abs_set_max(toccamiInput, ABS_Y, y);
-
-      // The driver relies on pointerIndex to communicate the resolution
-      input_abs_set_res(toccamiInput, ABS_X, pointerIndex);
-      input_abs_set_res(toccamiInput, ABS_Y, pointerIndex);
+  ret = toccami_client_enqueue(client, client->staging, touchCount, nonblock);
+  if (ret == 0 && client->format == TOCCAMI_FORMAT_COMPACT)
+    memcpy(&client->compact[0], &client->compact[1],
+           sizeof(client->compact[0]));
+  return ret;
+}
+
+/** @brief Queue a write(), writev() or io_uring write for the device worker,
+ * which reports it to the input core. All the segments of the iov_iter make
+ * a single write, records may cross segment boundaries.
+ * With TOCCAMI_FORMAT_RECORDS the write is made of TOCCAMI_EVENT_LENGTH
+ * records, TOCCAMI_EVENT_SYNC records split it in several frames and the
+ * records following the last separator are synced as one more frame.
+ * With TOCCAMI_FORMAT_COMPACT it is decoded to records first.
+ * The whole payload is copied with one copy_from_iter, so a write is either
+ * fully queued or rejected:
+ *  - a length that is not a multiple of TOCCAMI_EVENT_LENGTH fails with
+ * -EINVAL, as does a malformed compact write
+ *  - more than max_write_records records, or max_write_records *
+ * TOCCAMI_EVENT_LENGTH bytes, fail with -EMSGSIZE, frames are never split
+ * across several syncs
+ *  - a fault while copying fails with -EFAULT and reports nothing
+ *  - a full queue fails with -EAGAIN on O_NONBLOCK files and IOCB_NOWAIT
+ * requests, or waits for the device worker
+ */
+static ssize_t dev_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+  struct file *filep = iocb->ki_filp;
+  struct toccami_client *client = filep->private_data;
+  ktime_t start = ktime_get();
+  size_t len = iov_iter_count(from);
+  bool nonblock = iocb->ki_flags & IOCB_NOWAIT || filep->f_flags & O_NONBLOCK;
+  int ret;
+
+  if (iocb->ki_flags & IOCB_NOWAIT) {
+    if (!mutex_trylock(&client->lock))
+      return -EAGAIN;
+  } else if (mutex_lock_interruptible(&client->lock)) {
+    return -ERESTARTSYS;
+  }
+
+  ret = toccami_client_check_size(client, len);
+  if (ret)
+    goto out;
+
+  // Copy the whole frame at once
+  if (!copy_from_iter_full(toccami_client_payload(client), len, from)) {
+    this_cpu_inc(client->device->stats->faults);
+    ret = -EFAULT;
+    goto out;
+  }
+
+  ret = toccami_client_submit(client, len, nonblock);
+  if (ret == 0) {
+    this_cpu_add(client->device->stats->bytes, len);
+    this_cpu_inc(client->device->stats->writeLatency[toccami_latency_bucket(
+        ktime_to_ns(ktime_sub(ktime_get(), start)))]);
+  }
+
+out:
+  mutex_unlock(&client->lock);
+  return ret ? ret : len;
+}
+
+/** @brief Hand the records published in the shared memory ring to the
+ * device worker, which reports them in place on little-endian hosts.
+ * Frames are split by TOCCAMI_EVENT_SYNC records like in dev_write_iter.
+ *  @return The number of newly published records or a negative error
+ */
+static long toccami_ring_doorbell(struct toccami_client *client) {
+  u32 head, tail, count, first;
+
+  if (!smp_load_acquire(&client->ring))
+    return -EINVAL;
+  if (READ_ONCE(client->device->quiesce))
+    return -ESHUTDOWN;
+
+  head = smp_load_acquire(&client->ring->head);
+  tail = smp_load_acquire(&client->ringTail);
+
+  // The producer overwrote records that were not consumed yet
+  if (head - tail > client->ringSize) {
+    printk_ratelimited(KERN_ERR "toccami: ring overrun: head=%u tail=%u\n",
+                       head, tail);
+    return -EINVAL;
+  }
+
+  // A head behind the last announced one would wrap to a huge count
+  count = head - client->ringHead;
+  if (count > head - tail) {
+    printk_ratelimited(KERN_ERR
+                       "toccami: ring head moved back: head=%u last=%u\n",
+                       head, client->ringHead);
+    return -EINVAL;
+  }
+  if (count == 0)
+    return 0;
+
+  if (client->device->capture) {
+    first = min(count, client->ringSize -
+                           (client->ringHead & (client->ringSize - 1)));
+    toccami_capture_events(client->device,
+                           client->ringRecords +
+                               (client->ringHead & (client->ringSize - 1)),
+                           first);
+    toccami_capture_events(client->device, client->ringRecords,
+                           count - first);
+  }
+
+  smp_store_release(&client->ringHead, head);
+  queue_work(toccamiWq, &client->device->work);
+
+  return count;
+}
+
+/** @brief Give the client a private virtual touchpad instead of the shared
+ * one, like uinput does
+ *  @return The index of the new device, as in its phys "toccami/input%d"
+ */
+static long toccami_client_create_device(struct toccami_client *client) {
+  struct toccami_device *device;
+
+  if (client->ownsDevice)
+    return -EBUSY;
+
+  device = toccami_device_create();
+  if (IS_ERR(device))
+    return PTR_ERR(device);
+
+  toccami_device_detach(client);
+  toccami_device_attach(device, client);
+  client->ownsDevice = true;
 
+  // The status of the new device is pending, readers waiting on the shared
+  // one look again
+  atomic_set(&client->statusSeen, atomic_read(&device->statusSequence) - 1);
+  atomic_set(&client->ffSeen, atomic_read(&device->ffSequence));
+  wake_up_interruptible(&toccamiDefault->readWait);
+
+  return device->id;
+}
+
+/** @brief Submit the datagrams waiting on the UDP socket of a client as
+ * writes, without waiting for queue room, UDP_BUDGET at a time
+ */
+static void toccami_udp_work(struct work_struct *work) {
+  struct toccami_client *client =
+      container_of(work, struct toccami_client, udpWork);
+  struct sockaddr_in source;
+  struct msghdr msg;
+  struct kvec vec;
+  unsigned int budget;
+  int len, ret;
+
+  mutex_lock(&client->lock);
+  for (budget = UDP_BUDGET; client->udpSocket; budget--) {
+    if (!budget) {
+      queue_work(toccamiWq, &client->udpWork);
+      break;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &source;
+    msg.msg_namelen = sizeof(source);
+    vec.iov_base = toccami_client_payload(client);
+    vec.iov_len = max_write_records * TOCCAMI_EVENT_LENGTH;
+    len = kernel_recvmsg(client->udpSocket, &msg, &vec, 1, vec.iov_len,
+                         MSG_DONTWAIT);
+    if (len < 0)
+      break;
+
+    // Not from the producer, it is not ours to count
+    if ((client->udpBind.peerAddress &&
+         source.sin_addr.s_addr != client->udpBind.peerAddress) ||
+        (client->udpBind.peerPort &&
+         source.sin_port != client->udpBind.peerPort))
+      continue;
+
+    if (msg.msg_flags & MSG_TRUNC) {
+      this_cpu_inc(client->device->stats->invalidSize);
       continue;
     }
+    if (toccami_client_check_size(client, len))
+      continue;
 
-    // Debug information: Bad performance
-    // printk(KERN_DEBUG "x=%u, y=%u, pointer=%u, evType=%u\n", x, y,
-    // pointerIndex,
-    //        eventType);
+    ret = toccami_client_submit(client, len, true);
+    if (ret == -EAGAIN) {
+      this_cpu_inc(client->device->stats->udpDropped);
+      toccami_device_status_changed(client->device);
+    } else if (ret == -ESHUTDOWN) {
+      this_cpu_inc(client->device->stats->udpDropped);
+    } else if (ret == 0) {
+      this_cpu_add(client->device->stats->bytes, len);
+    }
+  }
+  mutex_unlock(&client->lock);
+}
 
-    input_mt_slot(toccamiInput,
-                  input_mt_get_slot_by_key(toccamiInput, pointerIndex));
+// Runs in softirq context
+static void toccami_udp_data_ready(struct sock *sk) {
+  struct toccami_client *client;
 
-    if (eventType == TOCCAMI_EVENT_DOWN) {
+  read_lock_bh(&sk->sk_callback_lock);
+  client = sk->sk_user_data;
+  if (client)
+    queue_work(toccamiWq, &client->udpWork);
+  read_unlock_bh(&sk->sk_callback_lock);
+}
 
-      input_mt_report_slot_state(toccamiInput, MT_TOOL_FINGER, 1);
+/** @brief Replace the UDP socket of a client and its peer, closing the
+ * previous socket. The work only uses the socket under client->lock, so it is
+ * done with the old one once the lock is dropped
+ */
+static void toccami_client_udp_set(struct toccami_client *client,
+                                   struct socket *sock,
+                                   const struct toccami_udp_bind *bind) {
+  struct socket *old;
+
+  if (sock) {
+    write_lock_bh(&sock->sk->sk_callback_lock);
+    sock->sk->sk_user_data = client;
+    sock->sk->sk_data_ready = toccami_udp_data_ready;
+    write_unlock_bh(&sock->sk->sk_callback_lock);
+  }
 
-      input_report_abs(toccamiInput, ABS_MT_POSITION_X, x);
-      input_report_abs(toccamiInput, ABS_MT_POSITION_Y, y);
+  mutex_lock(&client->lock);
+  old = client->udpSocket;
+  client->udpSocket = sock;
+  if (bind)
+    client->udpBind = *bind;
+  mutex_unlock(&client->lock);
 
-    } else {
-      input_mt_report_slot_state(toccamiInput, MT_TOOL_FINGER, 0);
+  if (old) {
+    write_lock_bh(&old->sk->sk_callback_lock);
+    old->sk->sk_user_data = NULL;
+    write_unlock_bh(&old->sk->sk_callback_lock);
+    sock_release(old);
+  }
+
+  // Datagrams received before the callback was set
+  if (sock)
+    queue_work(toccamiWq, &client->udpWork);
+}
+
+/** @brief Bind the in-kernel UDP receiver of a client, or close it for port 0
+ *  @return 0, or -EPERM without CAP_NET_ADMIN, -EFAULT, the errors of socket
+ * creation and bind
+ */
+static long toccami_client_udp_bind(struct toccami_client *client,
+                                    const struct toccami_udp_bind __user *arg) {
+  struct toccami_udp_bind bind;
+  struct sockaddr_in address = {.sin_family = AF_INET};
+  struct socket *sock = NULL;
+  int ret;
+
+  if (!capable(CAP_NET_ADMIN))
+    return -EPERM;
+  if (copy_from_user(&bind, arg, sizeof(bind)))
+    return -EFAULT;
+
+  if (bind.port) {
+    // Unlike a kernel socket, it holds a reference to the network namespace
+    // of the caller, which may go away while the file is open
+    ret = sock_create(AF_INET, SOCK_DGRAM, IPPROTO_UDP, &sock);
+    if (ret)
+      return ret;
+
+    address.sin_addr.s_addr = bind.address;
+    address.sin_port = bind.port;
+    ret = kernel_bind(sock, (struct sockaddr *)&address, sizeof(address));
+    if (ret) {
+      sock_release(sock);
+      return ret;
     }
   }
 
-  input_mt_sync_frame(toccamiInput);
-  input_sync(toccamiInput);
+  toccami_client_udp_set(client, sock, &bind);
+  return 0;
+}
 
-  return len;
+/** @brief Select the wire format of the next writes of a client
+ *  @return 0, or -EINVAL for an unknown format, -ENOMEM
+ */
+static long toccami_client_set_format(struct toccami_client *client,
+                                      unsigned long format) {
+  if (format != TOCCAMI_FORMAT_RECORDS && format != TOCCAMI_FORMAT_COMPACT)
+    return -EINVAL;
+
+  if (format == TOCCAMI_FORMAT_COMPACT && !client->compact) {
+    client->wire = kvmalloc(max_write_records * TOCCAMI_EVENT_LENGTH,
+                            GFP_KERNEL);
+    client->compact =
+        kmalloc_array(2, sizeof(*client->compact), GFP_KERNEL);
+    if (!client->wire || !client->compact) {
+      kvfree(client->wire);
+      kfree(client->compact);
+      client->wire = NULL;
+      client->compact = NULL;
+      return -ENOMEM;
+    }
+  }
+
+  if (client->compact)
+    bitmap_zero(client->compact[0].down, COMPACT_POINTERS);
+  client->format = format;
+  return 0;
+}
+
+/** @brief Change the axes of the device of a client once the records it
+ * already queued are reported
+ *  @return 0, or -EFAULT, -EINVAL for an empty range
+ */
+static long toccami_client_set_axes(struct toccami_client *client,
+                                    const struct toccami_axes __user *arg) {
+  struct toccami_device *device = client->device;
+  struct toccami_axes axes;
+
+  if (copy_from_user(&axes, arg, sizeof(axes)))
+    return -EFAULT;
+  if (!axes.xMax || !axes.yMax)
+    return -EINVAL;
+
+  queue_work(toccamiWq, &device->work);
+  flush_work(&device->work);
+
+  mutex_lock(&device->lock);
+  toccami_device_set_axes(device, axes.xMax, axes.yMax, axes.xResolution,
+                          axes.yResolution);
+  mutex_unlock(&device->lock);
+
+  return 0;
+}
+
+/** @brief Set the transform of the device of a client once the records it
+ * already queued are reported
+ *  @return 0, or -EFAULT, -EINVAL
+ */
+static long
+toccami_client_set_transform(struct toccami_client *client,
+                             const struct toccami_transform __user *arg) {
+  struct toccami_device *device = client->device;
+  struct toccami_transform transform;
+
+  if (copy_from_user(&transform, arg, sizeof(transform)))
+    return -EFAULT;
+  if (transform.rotation > TOCCAMI_ROTATE_270 ||
+      transform.flags & ~(TOCCAMI_FLIP_X | TOCCAMI_FLIP_Y) ||
+      transform.reserved)
+    return -EINVAL;
+
+  queue_work(toccamiWq, &device->work);
+  flush_work(&device->work);
+
+  mutex_lock(&device->lock);
+  device->transform = transform;
+  mutex_unlock(&device->lock);
+
+  return 0;
+}
+
+/** @brief Queue count records of a replay from the staging buffer, closed by
+ * a separator if the captured write had none, as ring doorbells may
+ */
+static int toccami_replay_write(struct toccami_client *client,
+                                unsigned int count) {
+  struct toccami_record *records = client->staging;
+
+  if (READ_ONCE(client->device->quiesce))
+    return -ESHUTDOWN;
+  if (records[count - 1].eventType != TOCCAMI_EVENT_SYNC)
+    records[count++] =
+        (struct toccami_record){.eventType = TOCCAMI_EVENT_SYNC};
+  return toccami_client_enqueue(client, records, count, false);
+}
+
+/** @brief Sleep until target on CLOCK_MONOTONIC
+ *  @return 0, or -EINTR if a signal is pending
+ */
+static int toccami_replay_wait(ktime_t target) {
+  set_current_state(TASK_INTERRUPTIBLE);
+  schedule_hrtimeout(&target, HRTIMER_MODE_ABS);
+  return signal_pending(current) ? -EINTR : 0;
+}
+
+/** @brief Write a capture to the device of a client, every group of entries
+ * with the same arrival time when it arrived relative to the first one.
+ * Called with client->lock held, for the whole replay
+ *  @return The number of entries, or -EFAULT, -EINVAL, -EINTR, -ESHUTDOWN
+ * once the device is drained
+ */
+static long toccami_client_replay(struct toccami_client *client,
+                                  const struct toccami_replay __user *arg) {
+  const struct toccami_capture_entry __user *entries;
+  struct toccami_capture_entry entry;
+  struct toccami_replay replay;
+  unsigned int count = 0;
+  u64 firstNs = 0, groupNs = 0;
+  ktime_t start;
+  u32 i;
+  int ret;
+
+  if (copy_from_user(&replay, arg, sizeof(replay)))
+    return -EFAULT;
+  if (replay.flags)
+    return -EINVAL;
+  if (READ_ONCE(client->device->quiesce))
+    return -ESHUTDOWN;
+
+  entries = u64_to_user_ptr(replay.entries);
+  start = ktime_get();
+
+  for (i = 0; i < replay.count; i++) {
+    if (copy_from_user(&entry, &entries[i], sizeof(entry)))
+      return -EFAULT;
+
+    if (i == 0) {
+      firstNs = entry.ns;
+      groupNs = entry.ns;
+    }
+
+    // The entry starts another write, or the current one is full
+    if (entry.ns != groupNs || count == max_write_records) {
+      ret = toccami_replay_write(client, count);
+      if (ret)
+        return ret;
+      count = 0;
+
+      if (entry.ns != groupNs && entry.ns > firstNs) {
+        ret = toccami_replay_wait(ktime_add_ns(start, entry.ns - firstNs));
+        if (ret)
+          return ret;
+      }
+      groupNs = entry.ns;
+    }
+
+    client->staging[count++] = (struct toccami_record){
+        .x = entry.x,
+        .y = entry.y,
+        .pointerIndex = entry.pointerIndex,
+        .eventType = entry.eventType};
+  }
+
+  if (count) {
+    ret = toccami_replay_write(client, count);
+    if (ret)
+      return ret;
+  }
+  return replay.count;
+}
+
+/** @brief Answer the ioctls reading the configuration and counters of the
+ * device of a client, they do not wait for writes blocked on client->lock
+ */
+static long toccami_client_get(struct toccami_client *client, unsigned int cmd,
+                               void __user *arg) {
+  struct toccami_device *device = READ_ONCE(client->device);
+  struct toccami_transform transform;
+  struct toccami_counters counters;
+  struct toccami_axes axes;
+  struct toccami_info info;
+
+  switch (cmd) {
+  case TOCCAMI_IOC_GET_AXES:
+    toccami_device_get_axes(device, &axes);
+    return copy_to_user(arg, &axes, sizeof(axes)) ? -EFAULT : 0;
+
+  case TOCCAMI_IOC_GET_TRANSFORM:
+    mutex_lock(&device->lock);
+    transform = device->transform;
+    mutex_unlock(&device->lock);
+    return copy_to_user(arg, &transform, sizeof(transform)) ? -EFAULT : 0;
+
+  case TOCCAMI_IOC_GET_INFO:
+    memset(&info, 0, sizeof(info));
+    info.version = TOCCAMI_VERSION;
+    if (device->contactAttrs)
+      info.features |= TOCCAMI_FEATURE_CONTACT_ATTRS;
+    if (device->gestures)
+      info.features |= TOCCAMI_FEATURE_GESTURES;
+    if (device->input->ff)
+      info.features |= TOCCAMI_FEATURE_FORCE_FEEDBACK;
+    if (device->outputPeriodNs)
+      info.features |= TOCCAMI_FEATURE_RESAMPLING;
+    if (hw_timestamps)
+      info.features |= TOCCAMI_FEATURE_HW_TIMESTAMPS;
+    if (device->pen)
+      info.features |= TOCCAMI_FEATURE_PEN;
+    if (device->capture)
+      info.features |= TOCCAMI_FEATURE_CAPTURE;
+    info.device = device->id;
+    info.slots = device->numSlots;
+    info.format = READ_ONCE(client->format);
+    info.maxWriteRecords = max_write_records;
+    info.queueRecords = kfifo_size(&client->queue);
+    info.maxPointerId = max_pointer_id;
+    return copy_to_user(arg, &info, sizeof(info)) ? -EFAULT : 0;
+
+  case TOCCAMI_IOC_GET_COUNTERS:
+    toccami_device_counters(device, &counters);
+    return copy_to_user(arg, &counters, sizeof(counters)) ? -EFAULT : 0;
+  }
+
+  return -ENOTTY;
+}
+
+/** @brief Drain the device of a client or resume it
+ *  @return 0, or -EPERM, -EINVAL
+ */
+static long toccami_client_drain_device(struct toccami_client *client,
+                                        unsigned long arg) {
+  if (!client->ownsDevice && !capable(CAP_SYS_ADMIN))
+    return -EPERM;
+  if (arg > 1)
+    return -EINVAL;
+
+  toccami_device_quiesce(client->device, QUIESCE_DRAIN, arg);
+  return 0;
+}
+
+static long dev_ioctl(struct file *filep, unsigned int cmd, unsigned long arg) {
+  struct toccami_client *client = filep->private_data;
+  long ret;
+
+  // Only takes client->lock around the socket swap
+  if (cmd == TOCCAMI_IOC_UDP_BIND)
+    return toccami_client_udp_bind(client, (void __user *)arg);
+
+  switch (cmd) {
+  case TOCCAMI_IOC_GET_AXES:
+  case TOCCAMI_IOC_GET_TRANSFORM:
+  case TOCCAMI_IOC_GET_INFO:
+  case TOCCAMI_IOC_GET_COUNTERS:
+    return toccami_client_get(client, cmd, (void __user *)arg);
+  }
+
+  if (mutex_lock_interruptible(&client->lock))
+    return -ERESTARTSYS;
+
+  switch (cmd) {
+  case TOCCAMI_IOC_RING_DOORBELL:
+    ret = toccami_ring_doorbell(client);
+    break;
+  case TOCCAMI_IOC_DEV_CREATE:
+    ret = toccami_client_create_device(client);
+    break;
+  case TOCCAMI_IOC_SET_FORMAT:
+    ret = toccami_client_set_format(client, arg);
+    break;
+  case TOCCAMI_IOC_SET_AXES:
+    ret = toccami_client_set_axes(client, (void __user *)arg);
+    break;
+  case TOCCAMI_IOC_SET_TRANSFORM:
+    ret = toccami_client_set_transform(client, (void __user *)arg);
+    break;
+  case TOCCAMI_IOC_REPLAY:
+    ret = toccami_client_replay(client, (void __user *)arg);
+    break;
+  case TOCCAMI_IOC_DRAIN:
+    ret = toccami_client_drain_device(client, arg);
+    break;
+  default:
+    ret = -ENOTTY;
+  }
+
+  mutex_unlock(&client->lock);
+  return ret;
+}
+
+/** @brief The client is writable when a write of max_write_records records
+ * would not wait for the device worker, and readable when a message of its
+ * device is pending
+ */
+static __poll_t dev_poll(struct file *filep, poll_table *wait) {
+  struct toccami_client *client = filep->private_data;
+  __poll_t mask = 0;
+
+  poll_wait(filep, &client->queueWait, wait);
+  poll_wait(filep, &READ_ONCE(client->device)->readWait, wait);
+
+  if (kfifo_avail(&client->queue) > max_write_records)
+    mask |= EPOLLOUT | EPOLLWRNORM;
+  if (toccami_client_readable(client))
+    mask |= EPOLLIN | EPOLLRDNORM;
+
+  return mask;
+}
+
+/** @brief Allocate the shared memory ring and map it in the producer address
+ * space: one header page followed by a power of two number of record pages.
+ */
+static int dev_mmap(struct file *filep, struct vm_area_struct *vma) {
+  struct toccami_client *client = filep->private_data;
+  unsigned long size = vma->vm_end - vma->vm_start;
+  unsigned long dataPages = (size >> PAGE_SHIFT) - 1;
+  void *ring;
+  int ret;
+
+  if (vma->vm_pgoff != 0 || size < 2 * PAGE_SIZE || size % PAGE_SIZE != 0 ||
+      !is_power_of_2(dataPages) || dataPages > TOCCAMI_RING_MAX_PAGES)
+    return -EINVAL;
+
+  if (atomic_xchg(&client->ringMapped, 1))
+    return -EBUSY;
+
+  ring = vmalloc_user(size);
+  if (!ring) {
+    ret = -ENOMEM;
+    goto fail;
+  }
+
+  ret = remap_vmalloc_range(vma, ring, 0);
+  if (ret) {
+    vfree(ring);
+    goto fail;
+  }
+
+  client->ringSize = dataPages * PAGE_SIZE / TOCCAMI_EVENT_LENGTH;
+  ((struct toccami_ring_header *)ring)->size = client->ringSize;
+  client->ringRecords = ring + PAGE_SIZE;
+  client->ringHead = 0;
+  client->ringTail = 0;
+  // Publishes the fields above to the doorbell and the device worker
+  smp_store_release(&client->ring, ring);
+  return 0;
+
+fail:
+  atomic_set(&client->ringMapped, 0);
+  return ret;
 }
 
 /** @brief The device release function that is called whenever the device is
@@ -257,10 +3451,29 @@ static ssize_t dev_write(struct file *filep, const char *buffer, size_t len,
  *  @param filep A pointer to a file object (defined in linux/fs.h)
  */
 static int dev_release(struct inode *inodep, struct file *filep) {
+  struct toccami_client *client = filep->private_data;
+
+  toccami_client_udp_set(client, NULL, NULL);
+  cancel_work_sync(&client->udpWork);
+
+  toccami_device_detach(client);
+  if (client->ownsDevice)
+    toccami_device_destroy(client->device);
+
+  // Every mapping holds a reference to the file, so the ring is unused here
+  vfree(client->ring);
+  kvfree(client->wire);
+  kfree(client->compact);
+  kfifo_free(&client->queue);
+  kvfree(client->slotByPointer);
+  kfree(client->compactBuffer);
+  kfree(client->staging);
+  mutex_destroy(&client->lock);
+  kfree(client);
+
   printk(KERN_INFO "Toccami: Device successfully closed\n");
-  mutex_unlock(&toccamiMutex);
   return 0;
 }
 
 module_init(toccami_init);
-module_exit(toccami_exit);
\ No newline at end of file
+module_exit(toccami_exit);
@@ -0,0 +1,337 @@
+#ifndef TOCCAMI_H
+#define TOCCAMI_H
+
+/* Interface shared between the Toccami driver and its userspace producers */
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/* Every event record written to /dev/toccamich or to its ring is made of
+ * four little-endian u16, whatever the byte order of the host
+ */
+struct toccami_event {
+  __le16 x;
+  __le16 y;
+  __le16 pointerIndex;
+  __le16 eventType;
+};
+
+#define TOCCAMI_EVENT_LENGTH 8
+
+#define TOCCAMI_EVENT_RELEASED 0
+#define TOCCAMI_EVENT_DOWN 1
+/* Same as TOCCAMI_IOC_SET_AXES with x and y as maximums and pointerIndex as
+ * the resolution of both axes. Kept for older producers, the ioctl is
+ * preferred
+ */
+#define TOCCAMI_EVENT_CHANGE_RESOLUTION 2
+/* Frame separator, the other fields are ignored: a single write() can carry
+ * several frames, each one is synced on its own
+ */
+#define TOCCAMI_EVENT_SYNC 3
+/* Capture time of the current frame in microseconds on the producer clock,
+ * 48 bits split in x (bits 0-15), y (bits 16-31) and pointerIndex
+ * (bits 32-47). Events of the frame are stamped with it instead of the
+ * arrival time, and it is forwarded as MSC_TIMESTAMP when the driver is
+ * loaded with hw_timestamps=1
+ */
+#define TOCCAMI_EVENT_TIMESTAMP 4
+/* Shape of a contact, following its TOCCAMI_EVENT_DOWN record in the same
+ * frame. Only reported when the driver is loaded with contact_attrs=1.
+ * x holds the pressure (bits 0-7, 0-255) and the orientation (bits 8-15, a
+ * signed byte where 127 is a quarter turn clockwise), y the touch major
+ * (bits 0-7) and minor (bits 8-15) lengths in coordinate units
+ */
+#define TOCCAMI_EVENT_CONTACT_ATTR 5
+/* Stylus sample, reported on the pen device of the touchpad when the driver
+ * is loaded with pen=1. It is synced on its own as soon as it is read,
+ * without waiting for the end of the frame. x and y are the position on the
+ * touchpad axes, pointerIndex holds the pressure (bits 0-11, 0 when
+ * hovering) and TOCCAMI_PEN_* flags. The pen is in proximity from its first
+ * sample to TOCCAMI_EVENT_PEN_OUT
+ */
+#define TOCCAMI_EVENT_PEN 6
+/* Tilt and hover distance of the stylus, applied with its next
+ * TOCCAMI_EVENT_PEN record: x and y are the tilt in degrees as signed
+ * 16-bit integers (-90 to 90, positive to the right and towards the user),
+ * pointerIndex the distance (0-255, reported while hovering)
+ */
+#define TOCCAMI_EVENT_PEN_TILT 7
+/* The stylus left proximity, the other fields are ignored */
+#define TOCCAMI_EVENT_PEN_OUT 8
+
+#define TOCCAMI_PEN_PRESSURE 0x0fff
+#define TOCCAMI_PEN_ERASER 0x1000
+#define TOCCAMI_PEN_BUTTON 0x2000
+#define TOCCAMI_PEN_BUTTON2 0x4000
+
+/* Shared memory ring
+ *
+ * mmap() the char device at offset 0 with a length of one header page
+ * followed by a power of two number of pages holding event records.
+ * The producer fills records at head, publishes them by advancing head (with
+ * release semantics) and then rings the doorbell ioctl: the driver reports
+ * every record between tail and head and advances tail.
+ * head and tail are free running counters, the record index is
+ * counter & (size - 1).
+ */
+struct toccami_ring_header {
+  __u32 head; // Written by the producer
+  __u32 tail; // Written by the driver
+  __u32 size; // Number of records in the ring, written by the driver
+  __u32 reserved;
+};
+
+#define TOCCAMI_RING_MAX_PAGES 256
+
+/* Wire formats of write(), selected with TOCCAMI_IOC_SET_FORMAT */
+#define TOCCAMI_FORMAT_RECORDS 0
+/* Compact format: a write is a sequence of frames, each one synced on its
+ * own. Integers are little endian and unaligned. A frame starts with
+ *   __u8 count, __u8 flags
+ * then, if flags has TOCCAMI_FRAME_TIMESTAMP, the 48-bit capture time in
+ * microseconds as 6 bytes, then count contacts
+ *   __u8 pointerIndex, __u8 kind, payload of kind
+ * Pointers missing from a frame are released, as with records, and need an
+ * absolute position again. A write fails as a whole with -EINVAL if it is
+ * malformed, and with -EMSGSIZE if it decodes to more than max_write_records
+ * records. Positions are only remembered from writes that succeeded. Stylus
+ * samples need the records format
+ */
+#define TOCCAMI_FORMAT_COMPACT 1
+
+#define TOCCAMI_FRAME_TIMESTAMP 0x01
+
+#define TOCCAMI_CONTACT_RELEASED 0
+/* __le16 x, __le16 y */
+#define TOCCAMI_CONTACT_ABSOLUTE 1
+/* __s8 dx, __s8 dy from the last position of a pointer down */
+#define TOCCAMI_CONTACT_DELTA 2
+/* No payload, a pointer down that did not move */
+#define TOCCAMI_CONTACT_STILL 3
+
+#define TOCCAMI_IOC_MAGIC 'T'
+
+/* Report the records published in the ring, returns how many were consumed */
+#define TOCCAMI_IOC_RING_DOORBELL _IO(TOCCAMI_IOC_MAGIC, 0x01)
+
+/* Create a virtual touchpad private to this open file, destroyed when it is
+ * closed. Returns N, the new device has phys "toccami/inputN"
+ */
+#define TOCCAMI_IOC_DEV_CREATE _IO(TOCCAMI_IOC_MAGIC, 0x02)
+
+/* Select the TOCCAMI_FORMAT_* given as argument for the next writes, fails
+ * with -EINVAL if the driver does not know it. Switching format forgets the
+ * positions of the compact format
+ */
+#define TOCCAMI_IOC_SET_FORMAT _IO(TOCCAMI_IOC_MAGIC, 0x03)
+
+/* Coordinate ranges, from 0 to the maximum, and resolutions in units per mm
+ * of the touchpad
+ */
+struct toccami_axes {
+  __u16 xMax;
+  __u16 yMax;
+  __u16 xResolution;
+  __u16 yResolution;
+};
+
+/* Change the axes of the touchpad of this file, both the single touch and the
+ * multitouch ones. Records written before are reported with the previous
+ * axes, contacts still down are released by a frame of their own and must go
+ * down again. The input device is not registered again, clients read the new
+ * ranges with EVIOCGABS
+ */
+#define TOCCAMI_IOC_SET_AXES _IOW(TOCCAMI_IOC_MAGIC, 0x04, struct toccami_axes)
+
+#define TOCCAMI_ROTATE_0 0
+#define TOCCAMI_ROTATE_90 1
+#define TOCCAMI_ROTATE_180 2
+#define TOCCAMI_ROTATE_270 3
+
+#define TOCCAMI_FLIP_X 0x01
+#define TOCCAMI_FLIP_Y 0x02
+
+/* Mapping of producer coordinates to the axes of the touchpad. A position
+ * from 0 to width, height is rotated clockwise by TOCCAMI_ROTATE_*, mirrored
+ * by the TOCCAMI_FLIP_* flags in the rotated space, multiplied by the 16.16
+ * fixed point scales, moved by the offsets and clamped to the axes.
+ * A width or height of 0 disables the transform
+ */
+struct toccami_transform {
+  __u16 width;
+  __u16 height;
+  __u32 xScale;
+  __u32 yScale;
+  __s32 xOffset;
+  __s32 yOffset;
+  __u8 rotation;
+  __u8 flags;
+  __u16 reserved; /* Must be 0 */
+};
+
+/* Transform the positions of the records written after this call, on the
+ * touchpad of this file, from every process writing to it
+ */
+#define TOCCAMI_IOC_SET_TRANSFORM                                              \
+  _IOW(TOCCAMI_IOC_MAGIC, 0x05, struct toccami_transform)
+
+/* Read back channel
+ *
+ * read() returns whole struct toccami_message, as many as fit, and fails with
+ * -EINVAL if not even one fits. poll() reports the file readable when one is
+ * pending. Messages are snapshots: several changes before a read are
+ * reported by a single message with the latest state
+ */
+#define TOCCAMI_MESSAGE_STATUS 0
+#define TOCCAMI_MESSAGE_RUMBLE 1
+
+/* Sent when a contact goes down or up, the axes change, records get
+ * dropped or the touchpad becomes idle, busy, drained or resumed
+ */
+struct toccami_status {
+  __u64 activeSlots; /* Bitmap of the slots down */
+  __u64 dropped;     /* Records merged by drop_motion and datagrams dropped */
+  __u64 coalesced;   /* Contacts skipped by coalesce_motion */
+  struct toccami_axes axes;
+  __u32 queued; /* Records of this file not reported yet */
+  __u32 flags;  /* TOCCAMI_STATUS_* */
+};
+
+/* No process has the touchpad or its gestures device open: records are
+ * thrown away until one does, producers can stop sending
+ */
+#define TOCCAMI_STATUS_IDLE 0x01
+/* The touchpad is drained by TOCCAMI_IOC_DRAIN or by a system suspend:
+ * what was queued is reported, contacts are released and writes fail with
+ * -ESHUTDOWN until it resumes
+ */
+#define TOCCAMI_STATUS_DRAINING 0x02
+
+/* Force feedback played on the touchpad, with the driver loaded with
+ * force_feedback=1. Magnitudes of 0 stop it
+ */
+struct toccami_rumble {
+  __u16 strong;
+  __u16 weak;
+};
+
+struct toccami_message {
+  __u16 type;
+  __u16 flags; /* 0 for now */
+  __u32 reserved;
+  union {
+    struct toccami_status status;
+    struct toccami_rumble rumble;
+    __u8 raw[48];
+  };
+};
+
+/* IPv4 address and port of the in-kernel UDP receiver, and of the only
+ * producer it accepts datagrams from, in network byte order
+ */
+struct toccami_udp_bind {
+  __be32 address;
+  __be16 port;
+  __be16 peerPort;    /* 0 accepts any source port */
+  __be32 peerAddress; /* 0 accepts any source address */
+};
+
+/* Bind a UDP socket in the kernel, needs CAP_NET_ADMIN. Every datagram it
+ * receives from the peer is handled as a write() to this file, in its
+ * current format, and dropped if the queue is full; datagrams from other
+ * sources are thrown away. It replaces the previous socket of the file, a
+ * port of 0 only closes it. The socket is closed with the file, and lives in
+ * the network namespace of the caller
+ */
+#define TOCCAMI_IOC_UDP_BIND                                                   \
+  _IOW(TOCCAMI_IOC_MAGIC, 0x06, struct toccami_udp_bind)
+
+/* Current axes and transform of the touchpad of this file */
+#define TOCCAMI_IOC_GET_AXES _IOR(TOCCAMI_IOC_MAGIC, 0x07, struct toccami_axes)
+#define TOCCAMI_IOC_GET_TRANSFORM                                              \
+  _IOR(TOCCAMI_IOC_MAGIC, 0x08, struct toccami_transform)
+
+/* Version of this interface, raised when records, messages or ioctls are
+ * added
+ */
+#define TOCCAMI_VERSION 4
+
+/* Features of the touchpad, from the module parameters at its creation */
+#define TOCCAMI_FEATURE_CONTACT_ATTRS 0x01
+#define TOCCAMI_FEATURE_GESTURES 0x02
+#define TOCCAMI_FEATURE_FORCE_FEEDBACK 0x04
+#define TOCCAMI_FEATURE_RESAMPLING 0x08
+#define TOCCAMI_FEATURE_HW_TIMESTAMPS 0x10
+#define TOCCAMI_FEATURE_PEN 0x20
+#define TOCCAMI_FEATURE_CAPTURE 0x40
+
+struct toccami_info {
+  __u32 version;  /* TOCCAMI_VERSION of the driver */
+  __u32 features; /* TOCCAMI_FEATURE_* */
+  __u32 device;   /* Index of the touchpad, as in its phys "toccami/input%d" */
+  __u16 slots;    /* Contacts tracked at once */
+  __u16 format;   /* TOCCAMI_FORMAT_* of the writes to this file */
+  __u32 maxWriteRecords; /* Records accepted by a single write() */
+  __u32 queueRecords;    /* Records queued for this file at most */
+  __u32 maxPointerId;    /* Records with a higher pointerIndex are ignored */
+  __u32 reserved;
+};
+
+#define TOCCAMI_IOC_GET_INFO _IOR(TOCCAMI_IOC_MAGIC, 0x09, struct toccami_info)
+
+/* Counters of the touchpad since its creation, shared by every process
+ * writing to it. Same values as the debugfs stats file
+ */
+struct toccami_counters {
+  __u64 records;
+  __u64 frames;
+  __u64 bytes;
+  __u64 invalidSize; /* Writes rejected for their size or content */
+  __u64 faults;      /* Writes that faulted while copied */
+  __u64 dropped;     /* Records merged by drop_motion */
+  __u64 coalesced;   /* Contacts skipped by coalesce_motion */
+  __u64 watchdog;    /* Frames releasing the contacts left down */
+  __u64 udpDropped;  /* Datagrams that found the queue full */
+};
+
+#define TOCCAMI_IOC_GET_COUNTERS                                               \
+  _IOR(TOCCAMI_IOC_MAGIC, 0x0a, struct toccami_counters)
+
+/* Capture and replay
+ *
+ * With capture_records set, every record accepted by a touchpad is kept,
+ * with its arrival time, in a ring of that many entries readable from
+ * /sys/kernel/debug/toccami/input<N>/capture, oldest entry first. The
+ * records of a write share its arrival time
+ */
+struct toccami_capture_entry {
+  __u64 ns; /* Arrival on CLOCK_MONOTONIC */
+  __u16 x;
+  __u16 y;
+  __u16 pointerIndex;
+  __u16 eventType;
+};
+
+struct toccami_replay {
+  __u64 entries; /* Pointer to count struct toccami_capture_entry */
+  __u32 count;
+  __u32 flags; /* Must be 0 */
+};
+
+/* Write a capture to the touchpad of this file with its original timing:
+ * entries sharing an arrival time make one write, sent that long after the
+ * first one. Blocks until the last entry is sent and returns count, or
+ * -EINTR if interrupted by a signal and -ESHUTDOWN once the touchpad is
+ * drained
+ */
+#define TOCCAMI_IOC_REPLAY _IOW(TOCCAMI_IOC_MAGIC, 0x0b, struct toccami_replay)
+
+/* With an argument of 1, report what is queued for the touchpad of this
+ * file, release its contacts and make every write to it fail with
+ * -ESHUTDOWN, e.g. before the module is reloaded. An argument of 0 resumes
+ * it. Needs CAP_SYS_ADMIN unless the touchpad was created by this file
+ */
+#define TOCCAMI_IOC_DRAIN _IO(TOCCAMI_IOC_MAGIC, 0x0c)
+
+#endif
@@ -0,0 +1,108 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM toccami
+
+#if !defined(_TOCCAMI_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TOCCAMI_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// A record taken from a client queue or ring, before it is interpreted
+TRACE_EVENT(toccami_record,
+  TP_PROTO(int device, u16 pointerIndex, u16 x, u16 y, u16 eventType),
+  TP_ARGS(device, pointerIndex, x, y, eventType),
+  TP_STRUCT__entry(
+    __field(int, device)
+    __field(u16, pointerIndex)
+    __field(u16, x)
+    __field(u16, y)
+    __field(u16, eventType)),
+  TP_fast_assign(
+    __entry->device = device;
+    __entry->pointerIndex = pointerIndex;
+    __entry->x = x;
+    __entry->y = y;
+    __entry->eventType = eventType;),
+  TP_printk("input%d pointer=%u x=%u y=%u type=%u", __entry->device,
+            __entry->pointerIndex, __entry->x, __entry->y, __entry->eventType));
+
+// A pointer went down and received a slot and an input tracking id
+TRACE_EVENT(toccami_slot_assign,
+  TP_PROTO(int device, int slot, u16 pointerIndex, int trackingId, u16 x,
+           u16 y),
+  TP_ARGS(device, slot, pointerIndex, trackingId, x, y),
+  TP_STRUCT__entry(
+    __field(int, device)
+    __field(int, slot)
+    __field(u16, pointerIndex)
+    __field(int, trackingId)
+    __field(u16, x)
+    __field(u16, y)),
+  TP_fast_assign(
+    __entry->device = device;
+    __entry->slot = slot;
+    __entry->pointerIndex = pointerIndex;
+    __entry->trackingId = trackingId;
+    __entry->x = x;
+    __entry->y = y;),
+  TP_printk("input%d slot=%d pointer=%u tracking_id=%d x=%u y=%u",
+            __entry->device, __entry->slot, __entry->pointerIndex,
+            __entry->trackingId, __entry->x, __entry->y));
+
+// A slot is free again, explicitly or because its pointer left the frame
+TRACE_EVENT(toccami_slot_release,
+  TP_PROTO(int device, int slot, u16 pointerIndex, u16 x, u16 y),
+  TP_ARGS(device, slot, pointerIndex, x, y),
+  TP_STRUCT__entry(
+    __field(int, device)
+    __field(int, slot)
+    __field(u16, pointerIndex)
+    __field(u16, x)
+    __field(u16, y)),
+  TP_fast_assign(
+    __entry->device = device;
+    __entry->slot = slot;
+    __entry->pointerIndex = pointerIndex;
+    __entry->x = x;
+    __entry->y = y;),
+  TP_printk("input%d slot=%d pointer=%u x=%u y=%u", __entry->device,
+            __entry->slot, __entry->pointerIndex, __entry->x, __entry->y));
+
+// In-band CHANGE_RESOLUTION record
+TRACE_EVENT(toccami_resolution,
+  TP_PROTO(int device, u16 xMax, u16 yMax, u16 resolution),
+  TP_ARGS(device, xMax, yMax, resolution),
+  TP_STRUCT__entry(
+    __field(int, device)
+    __field(u16, xMax)
+    __field(u16, yMax)
+    __field(u16, resolution)),
+  TP_fast_assign(
+    __entry->device = device;
+    __entry->xMax = xMax;
+    __entry->yMax = yMax;
+    __entry->resolution = resolution;),
+  TP_printk("input%d width=%u height=%u res=%u", __entry->device, __entry->xMax,
+            __entry->yMax, __entry->resolution));
+
+// input_sync of a frame, timestamp is its capture time or 0 if unknown
+TRACE_EVENT(toccami_frame_sync,
+  TP_PROTO(int device, unsigned int activeSlots, s64 timestamp),
+  TP_ARGS(device, activeSlots, timestamp),
+  TP_STRUCT__entry(
+    __field(int, device)
+    __field(unsigned int, activeSlots)
+    __field(s64, timestamp)),
+  TP_fast_assign(
+    __entry->device = device;
+    __entry->activeSlots = activeSlots;
+    __entry->timestamp = timestamp;),
+  TP_printk("input%d active=%u timestamp=%lld", __entry->device,
+            __entry->activeSlots, __entry->timestamp));
+
+#endif /* _TOCCAMI_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE toccami_trace
+#include <trace/define_trace.h>
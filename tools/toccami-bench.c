@@ -0,0 +1,612 @@
+/* Benchmark and recording tool for /dev/toccamich
+ *
+ *  toccami-bench run [options]   Write a synthetic stream and measure it
+ *  toccami-bench gen [options]   Write a synthetic stream to stdout
+ *  toccami-bench decode          Binary records on stdin to text on stdout
+ *  toccami-bench encode          Text records on stdin to binary on stdout
+ *  toccami-bench replay [-d DEV] Capture on stdin to the device, with its
+ *                                original timing
+ *
+ * The text format has one record per line, "x y pointerIndex type", where
+ * type is a number or one of the names printed by decode. '#' starts a
+ * comment. Captures are the debugfs capture file of a touchpad, e.g.
+ *  cat /sys/kernel/debug/toccami/input0/capture | toccami-bench replay
+ */
+
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/input.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "toccami.h"
+
+#define MAX_FINGERS 64
+
+// Little-endian on the wire, like struct toccami_event
+struct record {
+  uint16_t x;
+  uint16_t y;
+  uint16_t pointerIndex;
+  uint16_t eventType;
+};
+
+enum write_mode { MODE_WRITE, MODE_WRITEV, MODE_RING };
+
+struct options {
+  const char *device;
+  const char *eventDevice;
+  enum write_mode mode;
+  unsigned int fingers;
+  unsigned int rate;
+  unsigned int batch;
+  unsigned int frames;
+  unsigned int ringPages;
+  unsigned int xRange;
+  unsigned int yRange;
+};
+
+static const char *const eventNames[] = {
+    [TOCCAMI_EVENT_RELEASED] = "RELEASED",
+    [TOCCAMI_EVENT_DOWN] = "DOWN",
+    [TOCCAMI_EVENT_CHANGE_RESOLUTION] = "RESOLUTION",
+    [TOCCAMI_EVENT_SYNC] = "SYNC",
+    [TOCCAMI_EVENT_TIMESTAMP] = "TIMESTAMP",
+    [TOCCAMI_EVENT_CONTACT_ATTR] = "ATTR",
+    [TOCCAMI_EVENT_PEN] = "PEN",
+    [TOCCAMI_EVENT_PEN_TILT] = "PEN_TILT",
+    [TOCCAMI_EVENT_PEN_OUT] = "PEN_OUT",
+};
+
+#define EVENT_NAMES (sizeof(eventNames) / sizeof(eventNames[0]))
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns) {
+  struct timespec ts = {.tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000};
+
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+/* Records of a synthetic frame: every finger moves along X. The first one
+ * encodes the frame sequence in its X so that the reader can match the
+ * frames it gets back. The last frame releases every finger explicitly
+ * rather than relying on the release of contacts a frame leaves out
+ */
+static unsigned int make_frame(const struct options *options,
+                               unsigned int sequence, bool last,
+                               struct record *records) {
+  unsigned int i, count = 0;
+
+  for (i = 0; i < options->fingers && last; i++)
+    records[count++] = (struct record){
+        .pointerIndex = htole16(i),
+        .eventType = htole16(TOCCAMI_EVENT_RELEASED)};
+
+  for (i = 0; i < options->fingers && !last; i++)
+    records[count++] = (struct record){
+        .x = htole16((sequence + i * 97) % options->xRange),
+        .y = htole16((i + 1) * options->yRange / (options->fingers + 1)),
+        .pointerIndex = htole16(i),
+        .eventType = htole16(TOCCAMI_EVENT_DOWN)};
+
+  records[count++] =
+      (struct record){.eventType = htole16(TOCCAMI_EVENT_SYNC)};
+  return count;
+}
+
+/* Latency measurement */
+
+struct reader {
+  int fd;
+  unsigned int xRange;
+  // Send time of each frame, indexed by its sequence modulo xRange
+  uint64_t *sendNs;
+  uint64_t *latencies;
+  size_t latencyCount;
+  size_t latencyCapacity;
+  uint64_t events;
+  volatile bool stop;
+};
+
+static void *reader_main(void *arg) {
+  struct reader *reader = arg;
+  struct input_event events[64];
+  int slot = 0, x = -1;
+  ssize_t len;
+  size_t i;
+  uint64_t sent;
+
+  while (!reader->stop) {
+    len = read(reader->fd, events, sizeof(events));
+    if (len <= 0) {
+      if (len < 0 && errno != EAGAIN && errno != EINTR)
+        break;
+      usleep(100);
+      continue;
+    }
+
+    for (i = 0; i < len / sizeof(events[0]); i++) {
+      reader->events++;
+      if (events[i].type == EV_ABS && events[i].code == ABS_MT_SLOT)
+        slot = events[i].value;
+      else if (events[i].type == EV_ABS &&
+               events[i].code == ABS_MT_POSITION_X && slot == 0)
+        x = events[i].value;
+      else if (events[i].type == EV_SYN && events[i].code == SYN_REPORT &&
+               x >= 0 && (unsigned int)x < reader->xRange) {
+        sent = __atomic_load_n(&reader->sendNs[x], __ATOMIC_ACQUIRE);
+        if (sent && reader->latencyCount < reader->latencyCapacity)
+          reader->latencies[reader->latencyCount++] = now_ns() - sent;
+        x = -1;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t left = *(const uint64_t *)a, right = *(const uint64_t *)b;
+
+  return left < right ? -1 : left > right;
+}
+
+static void print_percentiles(uint64_t *latencies, size_t count) {
+  static const double percentiles[] = {50, 90, 99, 99.9};
+  size_t i;
+
+  if (!count) {
+    printf("latency: no frame read back\n");
+    return;
+  }
+
+  qsort(latencies, count, sizeof(latencies[0]), compare_u64);
+  printf("latency (%zu frames):", count);
+  for (i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+    printf(" p%g=%.1fus", percentiles[i],
+           latencies[(size_t)(percentiles[i] / 100 * (count - 1))] / 1000.0);
+  printf(" max=%.1fus\n", latencies[count - 1] / 1000.0);
+}
+
+/* Writers */
+
+struct ring {
+  struct toccami_ring_header *header;
+  struct record *records;
+  size_t mapLength;
+};
+
+static int ring_map(int fd, unsigned int pages, struct ring *ring) {
+  long pageSize = sysconf(_SC_PAGESIZE);
+  void *map;
+
+  ring->mapLength = (size_t)(pages + 1) * pageSize;
+  map = mmap(NULL, ring->mapLength, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+             0);
+  if (map == MAP_FAILED)
+    return -1;
+
+  ring->header = map;
+  ring->records = (struct record *)((char *)map + pageSize);
+  return 0;
+}
+
+// Queue count records in the ring and ring the doorbell
+static int ring_write(int fd, struct ring *ring, const struct record *records,
+                      unsigned int count) {
+  uint32_t head = ring->header->head, size = ring->header->size;
+  unsigned int i;
+
+  while (head - __atomic_load_n(&ring->header->tail, __ATOMIC_ACQUIRE) +
+             count >
+         size) {
+    if (ioctl(fd, TOCCAMI_IOC_RING_DOORBELL) < 0)
+      return -1;
+    usleep(50);
+  }
+
+  for (i = 0; i < count; i++)
+    ring->records[(head + i) & (size - 1)] = records[i];
+  __atomic_store_n(&ring->header->head, head + count, __ATOMIC_RELEASE);
+
+  return ioctl(fd, TOCCAMI_IOC_RING_DOORBELL) < 0 ? -1 : 0;
+}
+
+static int write_batch(int fd, const struct options *options,
+                       struct ring *ring, struct record *records,
+                       struct iovec *iov, unsigned int frameCount,
+                       unsigned int recordCount) {
+  size_t len = recordCount * sizeof(*records);
+
+  switch (options->mode) {
+  case MODE_WRITEV:
+    return writev(fd, iov, frameCount) == (ssize_t)len ? 0 : -1;
+  case MODE_RING:
+    return ring_write(fd, ring, records, recordCount);
+  default:
+    return write(fd, records, len) == (ssize_t)len ? 0 : -1;
+  }
+}
+
+static int run(const struct options *options) {
+  unsigned int frameRecords = options->fingers + 1;
+  struct record *records;
+  struct iovec *iov;
+  struct reader reader = {.fd = -1, .xRange = options->xRange};
+  struct ring ring = {0};
+  pthread_t readerThread;
+  uint64_t start, sent, elapsed, written = 0;
+  unsigned int sequence, frame, batchFrames, count;
+  int fd, ret = 1;
+
+  // A shared writable mapping of the ring needs the file open for reading
+  fd = open(options->device, options->mode == MODE_RING ? O_RDWR : O_WRONLY);
+  if (fd < 0) {
+    perror(options->device);
+    return 1;
+  }
+
+  records = calloc((size_t)options->batch * frameRecords, sizeof(*records));
+  iov = calloc(options->batch, sizeof(*iov));
+  if (!records || !iov)
+    goto out;
+
+  if (options->mode == MODE_RING &&
+      ring_map(fd, options->ringPages, &ring) < 0) {
+    perror("mmap");
+    goto out;
+  }
+
+  if (options->eventDevice) {
+    struct input_absinfo abs;
+    int clock = CLOCK_MONOTONIC;
+
+    reader.fd = open(options->eventDevice, O_RDONLY | O_NONBLOCK);
+    if (reader.fd < 0) {
+      perror(options->eventDevice);
+      goto out;
+    }
+    ioctl(reader.fd, EVIOCSCLOCKID, &clock);
+    if (ioctl(reader.fd, EVIOCGABS(ABS_MT_POSITION_X), &abs) == 0 &&
+        (unsigned int)abs.maximum < reader.xRange)
+      fprintf(stderr, "warning: X axis ends at %d, below the X range\n",
+              abs.maximum);
+    reader.sendNs = calloc(options->xRange, sizeof(*reader.sendNs));
+    reader.latencyCapacity = options->frames + 1;
+    reader.latencies = calloc(reader.latencyCapacity, sizeof(uint64_t));
+    if (!reader.sendNs || !reader.latencies)
+      goto out;
+    pthread_create(&readerThread, NULL, reader_main, &reader);
+  }
+
+  start = now_ns();
+  for (sequence = 0; sequence <= options->frames;) {
+    // Frames of a batch are sent together when the last one is due
+    for (frame = 0, count = 0;
+         frame < options->batch && sequence + frame <= options->frames;
+         frame++) {
+      iov[frame].iov_base = records + count;
+      iov[frame].iov_len =
+          make_frame(options, sequence + frame,
+                     sequence + frame == options->frames, records + count) *
+          sizeof(*records);
+      count += iov[frame].iov_len / sizeof(*records);
+    }
+
+    batchFrames = frame;
+
+    if (options->rate)
+      sleep_until(start + (uint64_t)(sequence + batchFrames - 1) *
+                              1000000000 / options->rate);
+
+    sent = now_ns();
+    if (reader.sendNs)
+      for (frame = 0; frame < batchFrames; frame++)
+        __atomic_store_n(
+            &reader.sendNs[(sequence + frame) % options->xRange], sent,
+            __ATOMIC_RELEASE);
+
+    if (write_batch(fd, options, &ring, records, iov, batchFrames, count) <
+        0) {
+      perror("write");
+      elapsed = now_ns() - start;
+      goto out_reader;
+    }
+
+    written += count;
+    sequence += batchFrames;
+  }
+  elapsed = now_ns() - start;
+
+  printf("written: %u frames, %llu records in %.3fs, %.0f records/s\n",
+         options->frames, (unsigned long long)written, elapsed / 1e9,
+         written * 1e9 / elapsed);
+  ret = 0;
+
+out_reader:
+  if (reader.fd >= 0) {
+    // Let the last frames come back
+    usleep(100000);
+    reader.stop = true;
+    pthread_join(readerThread, NULL);
+    printf("read back: %llu events, %.0f events/s\n",
+           (unsigned long long)reader.events, reader.events * 1e9 / elapsed);
+    print_percentiles(reader.latencies, reader.latencyCount);
+  }
+out:
+  if (ring.header)
+    munmap(ring.header, ring.mapLength);
+  if (reader.fd >= 0)
+    close(reader.fd);
+  free(reader.sendNs);
+  free(reader.latencies);
+  free(iov);
+  free(records);
+  close(fd);
+  return ret;
+}
+
+static int generate(const struct options *options) {
+  struct record records[MAX_FINGERS + 1];
+  unsigned int sequence, count;
+
+  for (sequence = 0; sequence <= options->frames; sequence++) {
+    count = make_frame(options, sequence, sequence == options->frames, records);
+    if (fwrite(records, sizeof(records[0]), count, stdout) != count)
+      return 1;
+  }
+  return 0;
+}
+
+/* Recordings */
+
+static int decode(void) {
+  struct record record;
+  unsigned long line = 0;
+
+  printf("# x y pointerIndex type\n");
+  while (fread(&record, sizeof(record), 1, stdin) == 1) {
+    line++;
+    record = (struct record){.x = le16toh(record.x),
+                             .y = le16toh(record.y),
+                             .pointerIndex = le16toh(record.pointerIndex),
+                             .eventType = le16toh(record.eventType)};
+    if (record.eventType < EVENT_NAMES && eventNames[record.eventType])
+      printf("%u %u %u %s\n", record.x, record.y, record.pointerIndex,
+             eventNames[record.eventType]);
+    else
+      printf("%u %u %u %u\n", record.x, record.y, record.pointerIndex,
+             record.eventType);
+  }
+
+  if (ferror(stdin) || !feof(stdin)) {
+    fprintf(stderr, "truncated record after %lu records\n", line);
+    return 1;
+  }
+  return 0;
+}
+
+static int encode(void) {
+  char buffer[256], type[32], *comment, *end;
+  unsigned int x, y, pointerIndex, i;
+  unsigned long line = 0, value;
+  struct record record;
+  bool found;
+
+  while (fgets(buffer, sizeof(buffer), stdin)) {
+    line++;
+    comment = strchr(buffer, '#');
+    if (comment)
+      *comment = '\0';
+    if (sscanf(buffer, " %c", type) != 1)
+      continue;
+
+    if (sscanf(buffer, "%u %u %u %31s", &x, &y, &pointerIndex, type) != 4 ||
+        x > UINT16_MAX || y > UINT16_MAX || pointerIndex > UINT16_MAX) {
+      fprintf(stderr, "line %lu: expected \"x y pointerIndex type\"\n", line);
+      return 1;
+    }
+
+    record = (struct record){.x = htole16(x),
+                             .y = htole16(y),
+                             .pointerIndex = htole16(pointerIndex)};
+    value = strtoul(type, &end, 0);
+    found = *end == '\0' && value <= UINT16_MAX;
+    for (i = 0; !found && i < EVENT_NAMES; i++) {
+      if (eventNames[i] && strcmp(eventNames[i], type) == 0) {
+        value = i;
+        found = true;
+      }
+    }
+    if (!found) {
+      fprintf(stderr, "line %lu: unknown type %s\n", line, type);
+      return 1;
+    }
+
+    record.eventType = htole16(value);
+    if (fwrite(&record, sizeof(record), 1, stdout) != 1)
+      return 1;
+  }
+  return 0;
+}
+
+static int replay(const struct options *options) {
+  struct toccami_capture_entry *entries = NULL, *grown;
+  size_t count = 0, capacity = 0;
+  struct toccami_replay request;
+  int fd, ret;
+
+  for (;;) {
+    if (count == capacity) {
+      capacity = capacity ? 2 * capacity : 4096;
+      grown = realloc(entries, capacity * sizeof(entries[0]));
+      if (!grown) {
+        perror("realloc");
+        free(entries);
+        return 1;
+      }
+      entries = grown;
+    }
+    if (fread(&entries[count], sizeof(entries[0]), 1, stdin) != 1)
+      break;
+    count++;
+  }
+  if (ferror(stdin) || count > UINT32_MAX) {
+    fprintf(stderr, "bad capture after %zu entries\n", count);
+    free(entries);
+    return 1;
+  }
+
+  fd = open(options->device, O_WRONLY);
+  if (fd < 0) {
+    perror(options->device);
+    free(entries);
+    return 1;
+  }
+
+  request = (struct toccami_replay){.entries = (uintptr_t)entries,
+                                    .count = count};
+  ret = ioctl(fd, TOCCAMI_IOC_REPLAY, &request);
+  if (ret < 0)
+    perror("TOCCAMI_IOC_REPLAY");
+  else
+    printf("replayed %d entries\n", ret);
+
+  close(fd);
+  free(entries);
+  return ret < 0;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: toccami-bench run|gen|decode|encode|replay [options]\n"
+          "  -d DEVICE  character device (/dev/toccamich)\n"
+          "  -e EVENT   evdev node to read back for latencies\n"
+          "  -m MODE    write, writev or ring (write)\n"
+          "  -f N       fingers (2, at most %d)\n"
+          "  -r HZ      frames per second, 0 as fast as possible (240)\n"
+          "  -b N       frames per write (1)\n"
+          "  -n N       frames (2400)\n"
+          "  -p N       ring pages, a power of two (16)\n"
+          "  -x N, -y N coordinate ranges (1000, 400)\n",
+          MAX_FINGERS);
+}
+
+int main(int argc, char **argv) {
+  struct options options = {
+      .device = "/dev/toccamich",
+      .mode = MODE_WRITE,
+      .fingers = 2,
+      .rate = 240,
+      .batch = 1,
+      .frames = 2400,
+      .ringPages = 16,
+      .xRange = 1000,
+      .yRange = 400,
+  };
+  const char *command;
+  int opt;
+
+  if (argc < 2) {
+    usage();
+    return 2;
+  }
+  command = argv[1];
+  optind = 2;
+
+  while ((opt = getopt(argc, argv, "d:e:m:f:r:b:n:p:x:y:")) != -1) {
+    switch (opt) {
+    case 'd':
+      options.device = optarg;
+      break;
+    case 'e':
+      options.eventDevice = optarg;
+      break;
+    case 'm':
+      if (strcmp(optarg, "writev") == 0)
+        options.mode = MODE_WRITEV;
+      else if (strcmp(optarg, "ring") == 0)
+        options.mode = MODE_RING;
+      else if (strcmp(optarg, "write") == 0)
+        options.mode = MODE_WRITE;
+      else {
+        usage();
+        return 2;
+      }
+      break;
+    case 'f':
+      options.fingers = strtoul(optarg, NULL, 0);
+      break;
+    case 'r':
+      options.rate = strtoul(optarg, NULL, 0);
+      break;
+    case 'b':
+      options.batch = strtoul(optarg, NULL, 0);
+      break;
+    case 'n':
+      options.frames = strtoul(optarg, NULL, 0);
+      break;
+    case 'p':
+      options.ringPages = strtoul(optarg, NULL, 0);
+      break;
+    case 'x':
+      options.xRange = strtoul(optarg, NULL, 0);
+      break;
+    case 'y':
+      options.yRange = strtoul(optarg, NULL, 0);
+      break;
+    default:
+      usage();
+      return 2;
+    }
+  }
+
+  if (options.fingers < 1 || options.fingers > MAX_FINGERS ||
+      options.batch < 1 || options.xRange < 1 || options.yRange < 1 ||
+      options.frames < 1) {
+    usage();
+    return 2;
+  }
+
+  // A batch is published at once, the ring has to hold it whole
+  if (options.mode == MODE_RING &&
+      (uint64_t)options.batch * (options.fingers + 1) * sizeof(struct record) >
+          (uint64_t)options.ringPages * sysconf(_SC_PAGESIZE)) {
+    fprintf(stderr, "ring of -p %u too small for batches of %u frames\n",
+            options.ringPages, options.batch);
+    return 2;
+  }
+
+  if (strcmp(command, "run") == 0)
+    return run(&options);
+  if (strcmp(command, "gen") == 0)
+    return generate(&options);
+  if (strcmp(command, "decode") == 0)
+    return decode();
+  if (strcmp(command, "encode") == 0)
+    return encode();
+  if (strcmp(command, "replay") == 0)
+    return replay(&options);
+
+  usage();
+  return 2;
+}